@@ -12,7 +12,7 @@
 #define AUDI_MAGIC 0x12345678
 /* file name can be at most 60 bytes. */
 #define AUDI_FILENAME_LEN 60
-/* each directory can have at most 64 files/sub directories. */
+/* each directory can have at most 64 files/sub directories, fewer with blocks smaller than 4KB, see AUDI_DIR_SLOTS(). */
 #define AUDI_MAX_SUBFILES 64
 #define AUDI_ROOT_INO 2
 #define AUDI_INODE_BLOCKS 5 /* reserve 5 blocks to store the inode table. */
@@ -40,40 +40,148 @@
  * +---------------+
  */
 
-#define AUDI_BLOCK_SIZE (1 << 12) /* each block is 4KB */
-#define	AUDI_N_BLOCKS	1 /* in audi file system, we only have 1 direct pointer */
-#define AUDI_MAX_FILESIZE \
-    (uint64_t) AUDI_N_BLOCKS * AUDI_BLOCK_SIZE /* in our very simple file system, the max size of a file is 4KB. */
+/* the block size is chosen by mkfs and stored in the superblock, see audi_block_size(). the layout above does not
+ * change: it is still 64 blocks, so a bigger block size means a bigger file system. images made before the block size
+ * was configurable have 0 in s_block_size, and 4KB blocks. */
+#define AUDI_MIN_BLOCK_SIZE (1 << 10)
+#define AUDI_MAX_BLOCK_SIZE (1 << 16)
+#define AUDI_DEFAULT_BLOCK_SIZE (1 << 12) /* each block is 4KB, unless mkfs is told otherwise */
+#define	AUDI_N_BLOCKS	8 /* in audi file system, we only have direct pointers, 8 of them */
+#define AUDI_MAX_FILESIZE(bs) \
+    ((uint64_t) AUDI_N_BLOCKS * (bs)) /* in our very simple file system, the max size of a file is 8 blocks, 32KB with 4KB blocks. */
+
+/* symlink targets shorter than this are stored in the inode itself, like ext2's fast symlinks,
+ * so following them does not read a data block. longer ones go into a data block. */
+#define AUDI_FAST_SYMLINK_LEN 128
 
 struct audi_inode {
 	uint32_t i_mode;   /* File mode */
 	uint32_t i_uid;    /* Owner id */
 	uint32_t i_gid;    /* Group id */
-	uint32_t i_size;   /* Size in bytes */
-	uint32_t i_ctime;  /* Inode change time */
-	uint32_t i_atime;  /* Access time */
-	uint32_t i_mtime;  /* Modification time */
+	uint32_t i_size;   /* Size in bytes, the low 32 bits with AUDI_FEATURE_INODE_V2 */
+	uint32_t i_ctime;  /* Inode change time, in seconds */
+	uint32_t i_atime;  /* Access time, in seconds */
+	uint32_t i_mtime;  /* Modification time, in seconds */
 	uint32_t i_nlink;  /* Hard links count */
-	uint32_t data_block;  /* Pointer to the block - we only support one block right now, in other words, each file/directory occupies at most one block.  */
-	char padding [220]; /* add padding so as to make this match with the one described in the book chapter: 256 bytes per inode. */
+	uint32_t i_block[AUDI_N_BLOCKS];  /* Pointers to the blocks, i_block[n] holds bytes n*4KB to (n+1)*4KB-1 of the file, 0 if not allocated (yet).
+									   * a directory always occupies exactly one block, i_block[0]. */
+	char i_symlink[AUDI_FAST_SYMLINK_LEN]; /* target of a fast symlink, NUL terminated; i_block[] is all 0 for these */
+	uint32_t i_flags;  /* File flags, AUDI_COMPR_FL is the only one so far */
+	/* version 2 of the inode, only meaningful with AUDI_FEATURE_INODE_V2. they used to be padding, so they are 0 on older images. */
+	uint32_t i_size_high;   /* Size in bytes, the high 32 bits */
+	uint32_t i_ctime_nsec;  /* nanoseconds of i_ctime */
+	uint32_t i_atime_nsec;  /* nanoseconds of i_atime */
+	uint32_t i_mtime_nsec;  /* nanoseconds of i_mtime */
+	uint32_t i_next_orphan; /* next inode on the orphan list, 0 ends it, see s_last_orphan */
+	char padding [32]; /* add padding so as to make this match with the one described in the book chapter: 256 bytes per inode. */
+	uint32_t i_dir_checksum; /* directories only: crc32c of the directory block, see AUDI_FEATURE_CSUM */
+	uint32_t i_checksum; /* crc32c of the inode number and of everything above, see AUDI_FEATURE_CSUM */
+};
+
+/* transparent compression, see compress.c. a regular file with AUDI_COMPR_FL is stored in clusters of
+ * AUDI_CLUSTER_BLOCKS blocks. a cluster which compresses well enough to save at least one block is stored compressed:
+ * its first block map entry is AUDI_COMPR_ADDR, the next ones point to the blocks holding a struct audi_compr_header
+ * followed by the compressed bytes, and the rest are 0. any other cluster is stored as is, one block per entry,
+ * 0 being a hole, just like in a file without the flag.
+ * the flag can only change while the file is empty, with chattr +c/-c, or new files get it with -o compress. */
+#define AUDI_COMPR_FL 0x00000004 /* same value as FS_COMPR_FL */
+#define AUDI_CLUSTER_BLOCKS 4
+#define AUDI_COMPR_ADDR 0xffffffff
+#define AUDI_COMPR_LZ4 1
+#define AUDI_COMPR_LZO 2
+struct audi_compr_header {
+	uint32_t c_len;   /* number of compressed bytes right after this header */
+	uint32_t c_algo;  /* AUDI_COMPR_LZ4 or AUDI_COMPR_LZO */
 };
 
-/* 4KB per block, 256 bytes per inode, thus, it's 4096/256=16 inodes per block. */
-#define AUDI_INODES_PER_BLOCK \
-    (AUDI_BLOCK_SIZE / sizeof(struct audi_inode))
+/* 256 bytes per inode, thus, with 4KB blocks, it's 4096/256=16 inodes per block. */
+#define AUDI_INODES_PER_BLOCK(bs) \
+    ((bs) / sizeof(struct audi_inode))
 
 /* super block data, follow ext2 and ext4 naming convention. 
- * as of now, this structure is 20 bytes. */
+ * as of now, this structure is 48 bytes. */
 struct audi_sb_info {
     uint32_t s_magic; /* Magic signature */
     uint32_t s_inodes_count; /* Total inodes count */
     uint32_t s_blocks_count; /* Total blocks count */
     uint32_t s_free_inodes_count; /* Free inodes count */
     uint32_t s_free_blocks_count; /* Free blocks count */
+    uint32_t s_itable_unused; /* Number of inodes at the end of the inode table which were never initialized, like ext4's bg_itable_unused */
+    uint32_t s_features; /* AUDI_FEATURE_*, 0 on images made before we had any */
+    uint32_t s_inode_bitmap_csum; /* crc32c of the inode bitmap, like ext4's bg_inode_bitmap_csum */
+    uint32_t s_data_bitmap_csum; /* crc32c of the data bitmap and the reference counts after it */
+    uint32_t s_block_size; /* in bytes, a power of 2 from AUDI_MIN_BLOCK_SIZE to AUDI_MAX_BLOCK_SIZE; 0 means 4KB */
+    uint32_t s_last_orphan; /* first inode on the orphan list, 0 if it is empty, like ext3's s_last_orphan:
+                             * inodes which lost their last name while still open. they keep their blocks until
+                             * the last iput(), and if we crash before that, the next mount frees them. */
+    uint32_t s_checksum; /* crc32c of everything above */
 };
 
-extern unsigned long long inode_bitmap;
-extern unsigned long long data_bitmap;
+static inline uint32_t audi_block_size(const struct audi_sb_info *sbi)
+{
+    return sbi->s_block_size ? sbi->s_block_size : AUDI_DEFAULT_BLOCK_SIZE;
+}
+
+/* metadata checksums, like ext4's metadata_csum: the superblock, the two bitmaps, every inode and every directory
+ * block carry a crc32c, which is checked when they are read from the disk, and recomputed when they are written.
+ * a directory block is full of entries, so its checksum lives in the directory's inode.
+ * a kernel which does not know one of the features in s_features refuses to mount the image. */
+#define AUDI_FEATURE_CSUM 0x0001
+/* version 2 of the on-disk inode: 64-bit sizes and nanosecond timestamps, see struct audi_inode.
+ * without it, an inode is version 1: the new fields are never read nor written, and times are kept in whole seconds. */
+#define AUDI_FEATURE_INODE_V2 0x0002
+#define AUDI_FEATURE_ALL (AUDI_FEATURE_CSUM | AUDI_FEATURE_INODE_V2)
+#define audi_has_csum(sbi) ((sbi)->s_features & AUDI_FEATURE_CSUM)
+#define audi_has_inode_v2(sbi) ((sbi)->s_features & AUDI_FEATURE_INODE_V2)
+
+static inline uint64_t audi_inode_size(const struct audi_sb_info *sbi, const struct audi_inode *inode)
+{
+    if (audi_has_inode_v2(sbi))
+        return ((uint64_t) inode->i_size_high << 32) | inode->i_size;
+    return inode->i_size;
+}
+
+static inline void audi_inode_set_size(const struct audi_sb_info *sbi, struct audi_inode *inode, uint64_t size)
+{
+    inode->i_size = (uint32_t) size;
+    if (audi_has_inode_v2(sbi))
+        inode->i_size_high = size >> 32;
+}
+
+/* mkfs only writes the first block of the inode table, the rest of the table may contain garbage.
+ * inodes from (s_inodes_count - s_itable_unused) onwards must be zeroed before they are handed out,
+ * one inode table block at a time. older images have 0 here, i.e., the whole table is initialized. */
+#define AUDI_ITABLE_INIT_BLOCKS 1
+
+/* reflinks: the data bitmap block also stores one byte per block, right after the bitmap itself:
+ * the number of block map entries pointing at that block, minus one. so 0 means the block has a single owner
+ * (or is free), which is what every block of an image made before reflinks has.
+ * a shared block is never written in place, see audi_unshare_page() in file.c. */
+#define AUDI_REFCOUNT_OFFSET 8
+#define AUDI_MAX_REFCOUNT 255
+
+/* mount options, like ext2 we keep them as bits. */
+#define AUDI_MOUNT_DISCARD 0x0001 /* discard freed blocks at sync time */
+#define AUDI_MOUNT_COMPRESS 0x0002 /* new regular files get AUDI_COMPR_FL */
+#define AUDI_MOUNT_DEFERFREE 0x0004 /* deleted inodes are freed in batches by a worker, see audi_reclaim() */
+#define set_opt(sb, opt) (AUDI_FS(sb)->s_mount_opt |= AUDI_MOUNT_##opt)
+#define clear_opt(sb, opt) (AUDI_FS(sb)->s_mount_opt &= ~AUDI_MOUNT_##opt)
+#define test_opt(sb, opt) (AUDI_FS(sb)->s_mount_opt & AUDI_MOUNT_##opt)
+
+/* AUDI_IOC_COPY_RANGE: copy a range of the file src_fd into the file the ioctl is called on, without the data
+ * going through userspace; see audi_copy_range() in ioctl.c. laid out like btrfs_ioctl_clone_range_args.
+ * the offsets must be block aligned, so must be the length, unless the range ends at the end of the source file.
+ * a length of 0 means up to the end of the source file. */
+struct audi_copy_range {
+    int64_t src_fd;
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint64_t dest_offset;
+};
+#define AUDI_IOC_COPY_RANGE _IOW('a', 1, struct audi_copy_range)
+/* AUDI_IOC_CLONE_RANGE: same arguments and rules, but the destination ends up sharing the source's blocks,
+ * until one of them writes to a shared block; see audi_clone_blocks() in ioctl.c. */
+#define AUDI_IOC_CLONE_RANGE _IOW('a', 2, struct audi_copy_range)
 
 /* structure of a directory entry, unliked the struct ext2_dir_entry, 
  * we do not store the length of this directory entry, or the name length. */
@@ -85,38 +193,201 @@ struct audi_dir_entry {
 /* each dir entry is (4 bytes + 60 bytes) = 64 bytes, 
  * and we allow each directory to have 64 subdirectories/files.
  * thus, 64 entries at most.
- * 64*64=4096=4KB, therefore each dir block occupies one data block. */
+ * 64*64=4096=4KB, therefore each dir block occupies one data block.
+ * a smaller block has room for fewer entries; a bigger one still only uses the first 4KB,
+ * so a directory, and its in-memory index, never has more than AUDI_MAX_SUBFILES slots. */
 struct audi_dir_block {
     struct audi_dir_entry entries[AUDI_MAX_SUBFILES];
 };
+#define AUDI_DIR_SLOTS(bs) \
+    ((bs) / sizeof(struct audi_dir_entry) < AUDI_MAX_SUBFILES ? (int) ((bs) / sizeof(struct audi_dir_entry)) : AUDI_MAX_SUBFILES)
+
+/* does the directory entry de have this name (len bytes, not NUL terminated)? this is used by every
+ * linear scan of a directory block, in the kernel module and in the userspace tools.
+ * names are at most AUDI_FILENAME_LEN bytes, and only shorter names are NUL terminated on disk,
+ * see ext2_match() in fs/ext2/dir.c. rather than a byte by byte strncmp() for each slot,
+ * we check the terminator, then compare the first 8 bytes as one word, which rejects almost every
+ * mismatch; only if they are equal do we memcmp() the rest. */
+static inline int audi_name_match(const struct audi_dir_entry *de, const char *name, int len)
+{
+    uint64_t a, b = 0;
 
+    if (len > AUDI_FILENAME_LEN || (len < AUDI_FILENAME_LEN && de->name[len]))
+        return 0;
+    memcpy(&a, de->name, sizeof(a));
+    memcpy(&b, name, len < 8 ? len : 8);
+    if (len < 8)
+        a &= (1ULL << (len * 8)) - 1; /* little endian: the first len bytes are the low ones */
+    if (a != b)
+        return 0;
+    return len <= 8 || !memcmp(de->name + 8, name + 8, len - 8);
+}
+
+/* the kernel has an accelerated crc32c, userspace gets the plain bitwise one; both give the same result. */
 #ifdef __KERNEL__
+#include <linux/crc32c.h>
+#define audi_crc32c(crc, buf, len) crc32c(crc, buf, len)
+#else
+static inline uint32_t audi_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    int k;
+
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+    return crc;
+}
+#endif
+#define AUDI_CRC32C_SEED (~0U)
+#define AUDI_INODE_BITMAP_CSUM_LEN 8 /* the inode bitmap is one 64-bit word */
+#define AUDI_DATA_BITMAP_CSUM_LEN (AUDI_REFCOUNT_OFFSET + AUDI_MAX_BLOCKS) /* the data bitmap and the reference counts */
+
+static inline uint32_t audi_sb_checksum(const struct audi_sb_info *sbi)
+{
+    return audi_crc32c(AUDI_CRC32C_SEED, sbi, offsetof(struct audi_sb_info, s_checksum));
+}
+
+/* the inode number goes in too, so an inode written into the wrong slot does not check out. */
+static inline uint32_t audi_inode_checksum(uint32_t ino, const struct audi_inode *inode)
+{
+    uint32_t crc = audi_crc32c(AUDI_CRC32C_SEED, &ino, sizeof(ino));
+
+    return audi_crc32c(crc, inode, offsetof(struct audi_inode, i_checksum));
+}
+
+#ifdef __KERNEL__
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
  
 extern struct kmem_cache * audi_inode_cachep;
 
+/* what we keep in memory for a mounted file system, hung off sb->s_fs_info, like ext2_sb_info.
+ * the superblock itself is s_sbi, which points into the buffer of block 0, see audi_fill_super(). */
+struct audi_fs_info {
+    struct audi_sb_info *s_sbi;
+    unsigned long s_mount_opt; /* AUDI_MOUNT_*, see test_opt() */
+    /* the bitmaps of blocks 1 and 2, read in audi_fill_super() and written back in audi_sync_fs(). */
+    unsigned long long s_inode_bitmap;
+    unsigned long long s_data_bitmap;
+    unsigned char s_data_refcount[AUDI_MAX_BLOCKS]; /* see AUDI_REFCOUNT_OFFSET */
+    /* protects the bitmaps, s_data_refcount, s_discard_bitmap, s_trim_bitmap and the free counts in the superblock:
+     * the allocators in bitmap.h run in whoever creates or writes a file, and the frees also run in audi_reclaim(). */
+    spinlock_t s_bitmap_lock;
+    struct mutex s_itable_mutex; /* serializes get_free_inode() and audi_init_itable(), see audi_new_inode() */
+    /* blocks freed since the last sync, same bit order as s_data_bitmap.
+     * with -o discard, audi_sync_fs() tells the device about them. */
+    unsigned long long s_discard_bitmap;
+    /* free blocks audi_discard_free_blocks() is discarding right now, get_free_block() leaves them alone. */
+    unsigned long long s_trim_bitmap;
+    /* the orphan list in memory, see audi_orphan_add() */
+    struct list_head s_orphans; /* on i_orphan */
+    struct mutex s_orphan_mutex; /* protects s_orphans and s_last_orphan */
+    /* deferred freeing, see AUDI_MOUNT_DEFERFREE and audi_reclaim() in super.c. */
+    struct workqueue_struct *s_reclaim_wq; /* NULL unless mounted with -o deferfree */
+    struct list_head s_reclaim_list; /* inodes waiting for the next batch, on i_reclaim */
+    spinlock_t s_reclaim_lock; /* protects s_reclaim_list */
+    struct delayed_work s_reclaim_work;
+    /* the batch in progress, only touched by the worker itself */
+    struct task_struct *s_reclaimer;
+    struct buffer_head *s_reclaim_bh; /* the inode table block we are writing into */
+    unsigned long long s_reclaim_blocks, s_reclaim_inodes; /* what the batch gives back at the end */
+};
+extern struct kmem_cache * audi_dir_index_cachep;
+
+/* in-memory name index of a directory, so lookup(), create() and unlink() do not have to parse
+ * the dentry table in the buffer again and again. it is built the first time we look something up
+ * in the directory, and it is freed by a shrinker when memory is tight, or when the inode goes away.
+ * entries are found by hashing their name into a bucket, and following the chain of slots from there;
+ * slot numbers are the same as in struct audi_dir_block. users must hold the directory's i_mutex. */
+#define AUDI_DIR_HASH_BUCKETS 16
+struct audi_dir_index {
+    unsigned char buckets[AUDI_DIR_HASH_BUCKETS]; /* first slot of the chain, 0 means empty: slots 0 and 1 are . and .. */
+    unsigned char next[AUDI_MAX_SUBFILES]; /* next slot in the chain, 0 ends it */
+    unsigned char len[AUDI_MAX_SUBFILES];  /* name length */
+    uint32_t hash[AUDI_MAX_SUBFILES];      /* full_name_hash() of the name */
+    uint32_t ino[AUDI_MAX_SUBFILES];       /* 0 if the slot is free */
+    char name[AUDI_MAX_SUBFILES][AUDI_FILENAME_LEN];
+    struct list_head lru;  /* on audi_dir_index_lru, for the shrinker */
+    struct inode *dir;     /* the directory this index belongs to */
+};
+
 struct audi_inode_info {
-    uint32_t data_block;  /* pointer for this file/dir */
+    uint32_t i_block[AUDI_N_BLOCKS];  /* block map for this file/dir, see struct audi_inode */
+    struct audi_dir_index *dir_index; /* directories only, NULL until the first lookup */
+    char i_symlink[AUDI_FAST_SYMLINK_LEN]; /* fast symlinks only, copy of the one on disk */
+    uint32_t i_flags; /* see struct audi_inode */
+    uint32_t i_dir_checksum; /* directories only, kept up to date by audi_dir_block_dirty() */
+    uint32_t i_next_orphan; /* see struct audi_inode */
+    uint32_t i_alloc_hint; /* directories only: the last inode created in it, see get_free_inode() */
+    struct list_head i_orphan; /* on s_orphans while the inode is on the orphan list */
+    struct list_head i_reclaim; /* waiting for audi_reclaim(), see AUDI_MOUNT_DEFERFREE */
     struct inode vfs_inode;
 };
 
 /* superblock functions */
 int audi_fill_super(struct super_block *sb, void *data, int silent);
+void audi_reclaim_queue(struct inode *inode);
 
 /* inode functions */
 struct inode *audi_iget(struct super_block *sb, unsigned long ino);
+void audi_release_inode(struct inode *inode, unsigned long long *blocks, unsigned long long *inodes);
+void audi_orphan_cleanup(struct super_block *sb);
+
+/* ioctl functions */
+long audi_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int audi_discard_free_blocks(struct super_block *sb, unsigned long long blocks, uint32_t minlen, uint64_t *trimmed);
+
+/* directory index functions */
+void audi_dir_index_build(struct inode *dir, struct audi_dir_block *dblock);
+uint32_t audi_dir_index_find(struct inode *dir, const unsigned char *name, int len);
+void audi_dir_index_add(struct inode *dir, int slot, uint32_t ino, const unsigned char *name, int len);
+void audi_dir_index_del(struct inode *dir, int slot);
+void audi_dir_index_free(struct inode *dir);
+void audi_dir_block_dirty(struct inode *dir, struct buffer_head *bh);
+int audi_dir_block_verify(struct inode *dir, struct buffer_head *bh);
+extern struct shrinker audi_dir_index_shrinker;
 
 /* file functions */
+unsigned long long audi_drop_blocks(struct inode *inode, loff_t size);
+void audi_truncate_blocks(struct inode *inode, loff_t size);
 extern const struct file_operations audi_file_ops;
 extern const struct inode_operations audi_file_inode_ops;
 extern const struct file_operations audi_dir_ops;
 extern const struct inode_operations audi_dir_inode_ops;
 extern const struct address_space_operations audi_aops;
 
+/* compression functions */
+void audi_compr_init(void);
+void audi_compr_exit(void);
+int audi_compr_algo(void);
+int audi_compr_truncate_page(struct inode *inode, loff_t newsize);
+extern const struct address_space_operations audi_compr_aops;
+
+/* symlink functions */
+extern const struct inode_operations audi_symlink_inode_ops;
+extern const struct inode_operations audi_fast_symlink_inode_ops;
+
 /* Getters for superbock and inode */
-#define AUDI_SB(sb) (sb->s_fs_info)
+#define AUDI_FS(sb) ((struct audi_fs_info *) (sb)->s_fs_info)
+#define AUDI_SB(sb) (AUDI_FS(sb)->s_sbi)
 #define AUDI_INODE(inode) \
     (container_of(inode, struct audi_inode_info, vfs_inode))
 
+static inline int audi_compressed(struct inode *inode)
+{
+	return AUDI_INODE(inode)->i_flags & AUDI_COMPR_FL;
+}
+
+/* number of entries in the block of directory dir. */
+static inline int audi_dir_slots(struct inode *dir)
+{
+	return AUDI_DIR_SLOTS(dir->i_sb->s_blocksize);
+}
+
 #endif /* __KERNEL__ */
 
 #endif /* AUDI_H */
@@ -23,19 +23,14 @@ MODULE_LICENSE("GPL");
 
 #define AUDI_DEBUG 1
 
-/* unsigned long long has 64 bits, equal to uint64_t 
- * unsigned int - 32bits, uint32_t; 
- * unsigned short - 16 bits, uint16_t; 
- * unsigned char - 8 bits, uint8_t */
-unsigned long long inode_bitmap=0;
-unsigned long long data_bitmap=0; 
-
 /* inodes are allocated/deallocated so frequently, 
  * it's better to reserve a memory pool from the slab memory system
  * so future allocation/deallocation will be faster, 
  * via kmem_cache_alloc() and kmem_cache_free(). */
 
 struct kmem_cache * audi_inode_cachep;
+/* same idea for the in-memory directory indexes, see struct audi_dir_index. */
+struct kmem_cache * audi_dir_index_cachep;
 
 static int audi_init_inodecache(void)
 {
@@ -46,6 +41,13 @@ static int audi_init_inodecache(void)
 											NULL);
 	if(audi_inode_cachep == NULL)
 		return -ENOMEM;
+	audi_dir_index_cachep = kmem_cache_create("audi_dir_index_cache",
+											sizeof(struct audi_dir_index),
+											0, (SLAB_RECLAIM_ACCOUNT|
+											SLAB_MEM_SPREAD),
+											NULL);
+	if(audi_dir_index_cachep == NULL)
+		return -ENOMEM;
 	return 0;
 }
 
@@ -57,6 +59,7 @@ static void audi_destroy_inodecache(void)
 	 * */
 	rcu_barrier();
 	kmem_cache_destroy(audi_inode_cachep);
+	kmem_cache_destroy(audi_dir_index_cachep);
 }
 
 static struct dentry *audi_mount(struct file_system_type *fs_type,
@@ -82,13 +85,20 @@ static int __init init_audi_fs(void)
 	int err = audi_init_inodecache();
 	if (err)
 		goto out;
-	err = register_filesystem(&audi_fs_type);
+	err = register_shrinker(&audi_dir_index_shrinker);
 	if (err)
 		goto out;
+	audi_compr_init();
+	err = register_filesystem(&audi_fs_type);
+	if (err)
+		goto out_compr;
 #ifdef AUDI_DEBUG
 	printk(KERN_WARNING "audi file system is loaded\n");
 #endif
 	return 0;
+out_compr:
+	audi_compr_exit();
+	unregister_shrinker(&audi_dir_index_shrinker);
 out:
 	audi_destroy_inodecache();
 	return err;
@@ -101,6 +111,8 @@ out:
 static void __exit exit_audi_fs(void)
 {
 	unregister_filesystem(&audi_fs_type);
+	audi_compr_exit();
+	unregister_shrinker(&audi_dir_index_shrinker);
 	audi_destroy_inodecache();
 #ifdef AUDI_DEBUG
 	printk(KERN_WARNING "audi file system is unloaded\n");
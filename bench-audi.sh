@@ -0,0 +1,127 @@
+#!/bin/bash
+
+# benchmarks of audi, run like test-audi.sh: mount an empty file system on test first.
+# every section cleans up after itself, and checks df -k gives back what it used, so leaks show up too.
+# the optional argument is how many times each loop runs.
+
+LOOPS=${1:-1000}
+TIMEFORMAT="%R seconds"
+cd test
+
+used() {
+    sync
+    df -k . | awk 'NR == 2 { print $3 }'
+}
+
+before=$(used)
+echo "file system uses ${before}KB at first, each loop runs $LOOPS times."
+
+echo ""
+echo "truncate and rewrite cycles, like a log rotator: write 32KB, truncate to 0 with O_TRUNC, write 16KB, truncate to 4KB:"
+full=$(head -c 32768 /dev/zero | tr '\0' x)
+half=${full:0:16384}
+time for ((i = 0; i < LOOPS; i++)); do
+    printf "%s" "$full" > log
+    printf "%s" "$half" > log
+    truncate -s 4096 log
+done
+rm -f log
+echo "after the loop the file system uses $(used)KB, it used ${before}KB before."
+
+echo ""
+echo "copying a 32KB file (the largest audi allows), with cp, then with copy.audi, which does not move the data through userspace:"
+head -c 32768 /dev/urandom > src
+sync
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+time for ((i = 0; i < LOOPS; i++)); do
+    cp src dst
+    rm -f dst
+done
+time for ((i = 0; i < LOOPS; i++)); do
+    ../copy.audi src dst
+    rm -f dst
+done
+rm -f src
+echo "after the loop the file system uses $(used)KB, it used ${before}KB before."
+
+echo ""
+echo "compression: writing 32KB of text and syncing it, to a plain file, then to a file with chattr +c:"
+text=$(yes "audi keeps compressible text in fewer blocks" | head -c 32768)
+touch plain compr
+chattr +c compr
+for f in plain compr; do
+    echo "$f:"
+    time for ((i = 0; i < LOOPS; i++)); do
+        printf "%s" "$text" > $f
+        sync
+    done
+done
+echo "reading them back, $((LOOPS / 10)) times, from disk every time:"
+for f in plain compr; do
+    echo "$f:"
+    time for ((i = 0; i < LOOPS / 10; i++)); do
+        echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+        cat $f > /dev/null
+    done
+done
+stat -c "%n %s %b" plain compr | awk '{ printf "%s: %d bytes in %d blocks of 512 bytes, ratio %.2f\n", $1, $2, $3, $2 / ($3 * 512) }'
+rm -f plain compr
+echo "after the loop the file system uses $(used)KB, it used ${before}KB before."
+
+echo ""
+echo "metadata: creating 50 files in a new directory, listing them with ls -l, then removing the directory, $((LOOPS / 10)) times;"
+echo "run this once on an image made by mkfs.audi, and once on an image made by mkfs.audi -C (no checksums), to see what the checksums cost:"
+time for ((i = 0; i < LOOPS / 10; i++)); do
+    mkdir meta
+    touch meta/file{1..50}
+    ls -l meta > /dev/null
+    rm -rf meta
+    sync
+done
+echo "after the loop the file system uses $(used)KB, it used ${before}KB before."
+
+echo ""
+echo "rm -rf of a tree of 2 directories with 20 one-block files each, then sync, $((LOOPS / 10)) times;"
+echo "with -o deferfree, rm -rf returns before the space is freed, and sync waits for it:"
+grep " $(pwd) audi " /proc/mounts
+rmtime=0
+synctime=0
+for ((i = 0; i < LOOPS / 10; i++)); do
+    mkdir tree tree/a tree/b
+    for ((f = 0; f < 20; f++)); do
+        printf "%s" "${full:0:4096}" > tree/a/$f
+        printf "%s" "${full:0:4096}" > tree/b/$f
+    done
+    sync
+    t0=$(date +%s%N)
+    rm -rf tree
+    t1=$(date +%s%N)
+    sync
+    t2=$(date +%s%N)
+    rmtime=$((rmtime + t1 - t0))
+    synctime=$((synctime + t2 - t1))
+done
+echo "rm -rf: $((rmtime / 1000000)) ms in total, sync afterwards: $((synctime / 1000000)) ms in total."
+echo "after the loop the file system uses $(used)KB, it used ${before}KB before."
+
+echo ""
+echo "inode-table locality: files are created in directories a and b in turn, all of a is deleted, then c is filled;"
+echo "for each directory, count the inode-table blocks ls -l has to read, the fewer the better:"
+per_block=$(($(stat -f -c %S .) / 256))
+itable_blocks() {
+    # the inode table starts at block 3, see inode_table_group() in bitmap.h.
+    ls -i "$1" | awk -v n=$per_block '{ b[int($1 / n) + 3] = 1 } END { s = ""; for (i in b) { c++; s = s " " i } print c " blocks:" s }'
+}
+mkdir a b c
+for ((f = 0; f < 16; f++)); do
+    touch a/$f b/$f
+done
+rm -f a/*
+for ((f = 0; f < 16; f++)); do
+    touch c/$f
+done
+for d in b c; do
+    echo "$d: $(itable_blocks $d)"
+done
+rm -rf a b c
+echo "after the loop the file system uses $(used)KB, it used ${before}KB before."
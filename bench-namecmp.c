@@ -0,0 +1,158 @@
+/**
+ * bench-namecmp.c - userspace microbenchmark of the name comparison used by directory scans.
+ *
+ * we build synthetic audi_dir_block images in memory, then look up every name of a block, plus as many
+ * names which are not there, by scanning the block linearly, the way audi_lookup() and audi_unlink() do.
+ * the scan is done three times: with strncmp() (what libaudi used to do), with a length check plus memcmp()
+ * (what the kernel module used to do), and with audi_name_match() from audi.h. the kernel module and libaudi
+ * now use the very same inline function, so what we measure here is what they run.
+ *
+ * two kinds of names are tried: names which differ early ("a0b1c2...") and names which share a long prefix
+ * ("logfile-2023-01-01-00001"), where the first 8 bytes do not tell them apart.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audi.h"
+
+#define NR_BLOCKS 256     /* synthetic directory blocks */
+#define DEFAULT_ROUNDS 200
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*match_fn)(const struct audi_dir_entry *de, const char *name, int len);
+
+/* what libaudi used to do; name is always NUL terminated here. */
+static int strncmp_match(const struct audi_dir_entry *de, const char *name, int len)
+{
+    return !strncmp(de->name, name, AUDI_FILENAME_LEN);
+}
+
+/* what audi_match() in the kernel module used to do. */
+static int memcmp_match(const struct audi_dir_entry *de, const char *name, int len)
+{
+    if (len < AUDI_FILENAME_LEN && de->name[len])
+        return 0;
+    return !memcmp(name, de->name, len);
+}
+
+static int word_match(const struct audi_dir_entry *de, const char *name, int len)
+{
+    return audi_name_match(de, name, len);
+}
+
+static const struct {
+    const char *name;
+    match_fn match;
+} kernels[] = {
+    { "strncmp",         strncmp_match },
+    { "memcmp",          memcmp_match },
+    { "audi_name_match", word_match },
+};
+
+#define NR_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* fill block b of blocks with AUDI_MAX_SUBFILES names, shared says which kind, see the top of this file. */
+static void fill_block(struct audi_dir_block *dblock, int b, int shared)
+{
+    int i;
+
+    memset(dblock, 0, sizeof(*dblock));
+    for (i = 0; i < AUDI_MAX_SUBFILES; i++) {
+        dblock->entries[i].inode = htole32(i + 1);
+        if (shared)
+            snprintf(dblock->entries[i].name, AUDI_FILENAME_LEN, "logfile-2023-01-01-%03d-%05d", b, i);
+        else
+            snprintf(dblock->entries[i].name, AUDI_FILENAME_LEN, "%c%x-%d-entry", 'a' + i % 26, i * 7919 + b, b);
+    }
+}
+
+/* look up every name of every block, and a name which is not there for each, return the time it took. */
+static double scan(struct audi_dir_block *blocks, match_fn match, int rounds, unsigned long *found)
+{
+    char miss[AUDI_FILENAME_LEN + 1] = { 0 };
+    double start = now();
+    int r, b, i, j, len;
+
+    for (r = 0; r < rounds; r++) {
+        for (b = 0; b < NR_BLOCKS; b++) {
+            for (i = 0; i < AUDI_MAX_SUBFILES; i++) {
+                char name[AUDI_FILENAME_LEN + 1] = { 0 };
+
+                len = strnlen(blocks[b].entries[i].name, AUDI_FILENAME_LEN);
+                memcpy(name, blocks[b].entries[i].name, len);
+                for (j = 0; j < AUDI_MAX_SUBFILES; j++) {
+                    if (blocks[b].entries[j].inode && match(&blocks[b].entries[j], name, len)) {
+                        (*found)++;
+                        break;
+                    }
+                }
+                /* same length, last byte changed: the worst miss for both kernels. */
+                memcpy(miss, name, len);
+                miss[len] = 0;
+                miss[len - 1] ^= 0x20;
+                for (j = 0; j < AUDI_MAX_SUBFILES; j++) {
+                    if (blocks[b].entries[j].inode && match(&blocks[b].entries[j], miss, len)) {
+                        (*found)++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv)
+{
+    static struct audi_dir_block blocks[NR_BLOCKS];
+    int rounds = argc > 1 ? atoi(argv[1]) : DEFAULT_ROUNDS;
+    int shared, b;
+
+    if (rounds < 1) {
+        fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (shared = 0; shared < 2; shared++) {
+        double slots = (double) rounds * NR_BLOCKS * AUDI_MAX_SUBFILES * 2 * AUDI_MAX_SUBFILES;
+        double t, base = 0;
+        unsigned long found, expect = 0;
+        int k;
+
+        for (b = 0; b < NR_BLOCKS; b++)
+            fill_block(&blocks[b], b, shared);
+        /* each lookup scans up to 64 slots, slots is an upper bound we only use to compare the kernels. */
+        printf("%s names:\n", shared ? "shared prefix" : "distinct");
+        for (k = 0; k < NR_KERNELS; k++) {
+            found = 0;
+            t = scan(blocks, kernels[k].match, rounds, &found);
+            if (!k) {
+                base = t;
+                expect = found;
+            }
+            printf("\t%-16s %8.3f s, %7.1f M slots/s, %.2fx\n", kernels[k].name, t, slots / t / 1e6, base / t);
+            if (found != expect) {
+                fprintf(stderr, "%s found %lu names, strncmp found %lu\n", kernels[k].name, found, expect);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4: */
@@ -8,6 +8,8 @@
 #ifndef AUDIFS_BITMAP_H
 #define AUDIFS_BITMAP_H
 
+#include <linux/bitops.h> /* for hweight64() */
+
 #include "audi.h"
 
 /* note this functions reports the bit index counting from right most (as 0).
@@ -33,54 +35,120 @@ static inline void audi_set_bit(int nr, void *addr)
         asm("btsl %1,%0" : "+m" (*(unsigned long *)addr) : "Ir" (nr));
 }
 
+/* the inodes which share an inode table block with inode ino, in the bit order of the inode bitmap. */
+static inline unsigned long long inode_table_group(struct audi_sb_info *sbi, unsigned int ino)
+{
+	unsigned int per_block = AUDI_INODES_PER_BLOCK(audi_block_size(sbi));
+
+	if (per_block >= 64)
+		return ~0ULL;
+	return (~0ULL << (64 - per_block)) >> (ino - ino % per_block);
+}
+
 /*
  * return an unused inode number and mark it used.
  * return 0 if no free inode was found.
+ * we look in the inode table block of goal first, then in the one of goal2, and only then anywhere:
+ * the inodes of a directory's entries then share a few inode table blocks, so ls -l reads fewer of them.
+ * a goal of 0 means no preference.
  */
-static inline unsigned int get_free_inode(struct audi_sb_info *sbi)
+static inline unsigned int get_free_inode(struct audi_fs_info *fsi, unsigned int goal, unsigned int goal2)
 {
-    unsigned int ret = get_first_zero_bit(inode_bitmap);
-    if (ret != 255) {
-    	audi_set_bit(ret, &inode_bitmap);
+    struct audi_sb_info *sbi = fsi->s_sbi;
+    unsigned long long group;
+    unsigned int ret;
+
+    spin_lock(&fsi->s_bitmap_lock);
+    if (goal && (~fsi->s_inode_bitmap & (group = inode_table_group(sbi, goal))))
+        ret = get_first_zero_bit(fsi->s_inode_bitmap | ~group);
+    else if (goal2 && (~fsi->s_inode_bitmap & (group = inode_table_group(sbi, goal2))))
+        ret = get_first_zero_bit(fsi->s_inode_bitmap | ~group);
+    else
+        ret = get_first_zero_bit(fsi->s_inode_bitmap);
+    /* with blocks smaller than 4KB, the inode table has fewer inodes than the bitmap has bits. */
+    if (ret != 255 && 63-ret < sbi->s_inodes_count) {
+    	audi_set_bit(ret, &fsi->s_inode_bitmap);
         sbi->s_free_inodes_count--;
+        spin_unlock(&fsi->s_bitmap_lock);
 		return (63-ret); // again, the bit index returned by get_first_zero_bit is counting from the right most, yet we want to count from the left most.
 	}
+    spin_unlock(&fsi->s_bitmap_lock);
     return 0;
 }
 
 /*
  * return a block number and mark it used.
- * return 0 if no free block was found.
+ * return 0 if no free block was found; blocks which are being discarded do not count as free.
  */
-static unsigned int get_free_block(struct audi_sb_info *sbi)
+static unsigned int get_free_block(struct audi_fs_info *fsi)
 {
-    uint64_t ret = get_first_zero_bit(data_bitmap);
+    uint64_t ret;
+
+    spin_lock(&fsi->s_bitmap_lock);
+    ret = get_first_zero_bit(fsi->s_data_bitmap | fsi->s_trim_bitmap);
     if (ret != 255) {
-    	audi_set_bit(ret, &data_bitmap);
-        sbi->s_free_blocks_count--;
+    	audi_set_bit(ret, &fsi->s_data_bitmap);
+		/* the block is in use again, it must not be discarded at the next sync. */
+		fsi->s_discard_bitmap &= ~(1ULL << ret);
+        fsi->s_sbi->s_free_blocks_count--;
+        spin_unlock(&fsi->s_bitmap_lock);
 		return (63-ret); // again, the bit index returned by get_first_zero_bit is counting from the right most, yet we want to count from the left most.
 	}
+    spin_unlock(&fsi->s_bitmap_lock);
     return 0;
 }
 
 /* mark an inode as unused */
-void put_inode(struct audi_sb_info *sbi, uint32_t ino)
+static inline void put_inode(struct audi_fs_info *fsi, uint32_t ino)
 {
-	pr_info("ino is %d, inode bitmap was 0x%llx\n", ino, inode_bitmap);
+	pr_info("ino is %d, inode bitmap was 0x%llx\n", ino, fsi->s_inode_bitmap);
 	/* clear bit ino and increment number of free inodes */
-	inode_bitmap &= ~(1ULL << (63-ino)); // again, we need 63- here because that's how we use our bitmap.
-    sbi->s_free_inodes_count++;
-	pr_info("ino is %d, inode bitmap is 0x%llx\n", ino, inode_bitmap);
+	spin_lock(&fsi->s_bitmap_lock);
+	fsi->s_inode_bitmap &= ~(1ULL << (63-ino)); // again, we need 63- here because that's how we use our bitmap.
+    fsi->s_sbi->s_free_inodes_count++;
+	spin_unlock(&fsi->s_bitmap_lock);
+	pr_info("ino is %d, inode bitmap is 0x%llx\n", ino, fsi->s_inode_bitmap);
+}
+
+/* mark a set of inodes as unused, inodes has the same bit order as the inode bitmap; see put_blocks() below. */
+static inline void put_inodes(struct audi_fs_info *fsi, unsigned long long inodes)
+{
+	pr_info("inode bitmap was 0x%llx\n", fsi->s_inode_bitmap);
+	spin_lock(&fsi->s_bitmap_lock);
+	fsi->s_inode_bitmap &= ~inodes;
+    fsi->s_sbi->s_free_inodes_count += hweight64(inodes);
+	spin_unlock(&fsi->s_bitmap_lock);
+	pr_info("inode bitmap is 0x%llx\n", fsi->s_inode_bitmap);
+}
+
+/* drop one reference to block bno, see AUDI_REFCOUNT_OFFSET in audi.h.
+ * return 1 if it was the last one, i.e., the block should now be marked unused. */
+static inline int put_block_ref(struct audi_fs_info *fsi, uint32_t bno)
+{
+	int last = 1;
+
+	spin_lock(&fsi->s_bitmap_lock);
+	if (fsi->s_data_refcount[bno]) {
+		fsi->s_data_refcount[bno]--;
+		last = 0;
+	}
+	spin_unlock(&fsi->s_bitmap_lock);
+	return last;
 }
 
-/* mark a block as unused */
-void put_block(struct audi_sb_info *sbi, uint32_t bno)
+/* mark a set of blocks as unused, blocks has the same bit order as the data bitmap.
+ * the caller has already dropped its references with put_block_ref(), these are the blocks which had no other.
+ * truncating a file frees many blocks at once, this way we only update the bitmap and the free count once. */
+static inline void put_blocks(struct audi_fs_info *fsi, unsigned long long blocks)
 {
-	pr_info("data bitmap was 0x%llx\n", data_bitmap);
-	/* clear bit bno and increment number of free blocks */
-	data_bitmap &= ~(1ULL << (63-bno)); // again, we need 63- here because that's how we use our bitmap.
-    sbi->s_free_blocks_count++;
-	pr_info("data bitmap is 0x%llx\n", data_bitmap);
+	pr_info("data bitmap was 0x%llx\n", fsi->s_data_bitmap);
+	spin_lock(&fsi->s_bitmap_lock);
+	fsi->s_data_bitmap &= ~blocks;
+	if (fsi->s_mount_opt & AUDI_MOUNT_DISCARD)
+		fsi->s_discard_bitmap |= blocks;
+    fsi->s_sbi->s_free_blocks_count += hweight64(blocks);
+	spin_unlock(&fsi->s_bitmap_lock);
+	pr_info("data bitmap is 0x%llx\n", fsi->s_data_bitmap);
 }
 
 #endif /* AUDIFS_BITMAP_H */
@@ -0,0 +1,474 @@
+/**
+ * compress.c - in this file we implement transparent compression of regular files.
+ * the idea is borrowed from f2fs: a file with AUDI_COMPR_FL is cut into clusters of AUDI_CLUSTER_BLOCKS blocks,
+ * writeback compresses a whole cluster at a time, and readpage decompresses it; see AUDI_COMPR_ADDR in audi.h for
+ * how a compressed cluster is recorded in the block map.
+ * the data of such a file never goes through buffer heads attached to its pages: we read and write the blocks
+ * ourselves, with sb_bread()/sb_getblk(), so the page cache of the file never maps a compressed block.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/buffer_head.h>
+#include <linux/writeback.h>
+#include <linux/crypto.h>
+#include <linux/lzo.h>
+
+#include "bitmap.h"
+#include "audi.h"
+
+/* a compressed file is only ever found on a file system whose block size is the page size, see audi_fill_super()
+ * and audi_setflags(), so here a block is a page. */
+#define AUDI_CLUSTER_SIZE (AUDI_CLUSTER_BLOCKS * PAGE_CACHE_SIZE)
+
+/* room for the header and for what the compressor writes when the data does not compress at all,
+ * lzo's worst case is the bigger one. */
+#define AUDI_COMPR_BUF_SIZE \
+	(sizeof(struct audi_compr_header) + lzo1x_worst_compress(AUDI_CLUSTER_SIZE))
+
+/* one transform per algorithm we know, indexed by c_algo; either one may be missing from the kernel.
+ * lz4 is what we write when we have it, lzo otherwise. */
+static struct crypto_comp *audi_compr_tfm[AUDI_COMPR_LZO + 1];
+static const char *audi_compr_names[AUDI_COMPR_LZO + 1] = {
+	[AUDI_COMPR_LZ4] = "lz4",
+	[AUDI_COMPR_LZO] = "lzo",
+};
+/* a transform has a single work area, so only one user at a time. this also keeps writeback and readpage
+ * from seeing a cluster's block map entries half way through an update. */
+static DEFINE_MUTEX(audi_compr_mutex);
+
+void audi_compr_init(void)
+{
+	int i;
+
+	for (i = AUDI_COMPR_LZ4; i <= AUDI_COMPR_LZO; i++) {
+		audi_compr_tfm[i] = crypto_alloc_comp(audi_compr_names[i], 0, 0);
+		if (IS_ERR(audi_compr_tfm[i])) {
+			pr_info("%s is not available\n", audi_compr_names[i]);
+			audi_compr_tfm[i] = NULL;
+		}
+	}
+}
+
+void audi_compr_exit(void)
+{
+	int i;
+
+	for (i = AUDI_COMPR_LZ4; i <= AUDI_COMPR_LZO; i++) {
+		if (audi_compr_tfm[i])
+			crypto_free_comp(audi_compr_tfm[i]);
+	}
+}
+
+/* the algorithm new clusters are compressed with, 0 if we have none. */
+int audi_compr_algo(void)
+{
+	if (audi_compr_tfm[AUDI_COMPR_LZ4])
+		return AUDI_COMPR_LZ4;
+	if (audi_compr_tfm[AUDI_COMPR_LZO])
+		return AUDI_COMPR_LZO;
+	return 0;
+}
+
+/*
+ * read cluster of inode into buf, AUDI_CLUSTER_SIZE bytes: decompress it if it is compressed,
+ * otherwise just copy its blocks. holes read as zeroes. the caller holds audi_compr_mutex.
+ */
+static int audi_read_cluster(struct inode *inode, int cluster, char *buf)
+{
+	struct super_block *sb = inode->i_sb;
+	uint32_t *map = &AUDI_INODE(inode)->i_block[cluster * AUDI_CLUSTER_BLOCKS];
+	struct audi_compr_header *hdr;
+	struct buffer_head *bh;
+	unsigned int c_len, dlen;
+	char *cbuf;
+	int i, n, ret;
+
+	memset(buf, 0, AUDI_CLUSTER_SIZE);
+	if (map[0] != AUDI_COMPR_ADDR) {
+		for (i = 0; i < AUDI_CLUSTER_BLOCKS; i++) {
+			if (!map[i])
+				continue;
+			bh = sb_bread(sb, map[i]);
+			if (!bh)
+				return -EIO;
+			memcpy(buf + i * PAGE_CACHE_SIZE, bh->b_data, PAGE_CACHE_SIZE);
+			brelse(bh);
+		}
+		return 0;
+	}
+
+	cbuf = kmalloc(AUDI_CLUSTER_SIZE, GFP_NOFS);
+	if (!cbuf)
+		return -ENOMEM;
+	/* the compressed blocks follow the marker, up to the first 0. */
+	for (n = 0; n + 1 < AUDI_CLUSTER_BLOCKS && map[n + 1]; n++) {
+		bh = sb_bread(sb, map[n + 1]);
+		if (!bh) {
+			ret = -EIO;
+			goto out;
+		}
+		memcpy(cbuf + n * PAGE_CACHE_SIZE, bh->b_data, PAGE_CACHE_SIZE);
+		brelse(bh);
+	}
+
+	ret = -EIO;
+	hdr = (struct audi_compr_header *) cbuf;
+	c_len = le32_to_cpu(hdr->c_len);
+	i = le32_to_cpu(hdr->c_algo);
+	if (c_len > n * PAGE_CACHE_SIZE - sizeof(*hdr) || i < AUDI_COMPR_LZ4 || i > AUDI_COMPR_LZO) {
+		pr_info("inode %lu: cluster %d is corrupted\n", inode->i_ino, cluster);
+		goto out;
+	}
+	if (!audi_compr_tfm[i]) {
+		pr_info("inode %lu: cluster %d needs %s, which is not available\n", inode->i_ino, cluster, audi_compr_names[i]);
+		goto out;
+	}
+	dlen = AUDI_CLUSTER_SIZE;
+	if (crypto_comp_decompress(audi_compr_tfm[i], cbuf + sizeof(*hdr), c_len, buf, &dlen)) {
+		pr_info("inode %lu: cluster %d does not decompress\n", inode->i_ino, cluster);
+		goto out;
+	}
+	ret = 0;
+out:
+	kfree(cbuf);
+	return ret;
+}
+
+/*
+ * fill the locked page from the disk and mark it uptodate. the other pages of its cluster come out of the same
+ * decompression, so we fill those which are in the page cache but not uptodate, or not in the page cache at all,
+ * as long as we can lock them without waiting.
+ */
+static int audi_compr_read_page(struct inode *inode, struct page *page)
+{
+	struct address_space *mapping = inode->i_mapping;
+	int cluster = page->index / AUDI_CLUSTER_BLOCKS;
+	pgoff_t index = (pgoff_t) cluster * AUDI_CLUSTER_BLOCKS;
+	loff_t isize = i_size_read(inode);
+	struct page *p;
+	char *buf;
+	int i, ret;
+
+	buf = kmalloc(AUDI_CLUSTER_SIZE, GFP_NOFS);
+	if (!buf)
+		return -ENOMEM;
+	mutex_lock(&audi_compr_mutex);
+	ret = audi_read_cluster(inode, cluster, buf);
+	mutex_unlock(&audi_compr_mutex);
+	if (ret) {
+		SetPageError(page);
+		goto out;
+	}
+
+	for (i = 0; i < AUDI_CLUSTER_BLOCKS; i++) {
+		if (index + i == page->index) {
+			p = page;
+		} else {
+			if (((loff_t) (index + i) << PAGE_CACHE_SHIFT) >= isize)
+				continue;
+			p = grab_cache_page_nowait(mapping, index + i);
+			if (!p)
+				continue;
+			if (PageUptodate(p)) {
+				unlock_page(p);
+				page_cache_release(p);
+				continue;
+			}
+		}
+		memcpy(kmap(p), buf + i * PAGE_CACHE_SIZE, PAGE_CACHE_SIZE);
+		kunmap(p);
+		flush_dcache_page(p);
+		SetPageUptodate(p);
+		if (p != page) {
+			unlock_page(p);
+			page_cache_release(p);
+		}
+	}
+out:
+	kfree(buf);
+	return ret;
+}
+
+static int audi_compr_readpage(struct file *file, struct page *page)
+{
+	int ret = audi_compr_read_page(page->mapping->host, page);
+
+	unlock_page(page);
+	return ret;
+}
+
+/*
+ * write the whole cluster page belongs to. the cluster is put together from the page cache, and from the disk for
+ * pages which are not in the page cache; then it is compressed, and if that saves at least one block, the compressed
+ * bytes go to disk, otherwise the cluster goes as is. either way it goes into new blocks, and the old ones are freed
+ * once the block map points to the new ones, so a crash never leaves a cluster half old, half new.
+ * other dirty pages of the cluster which we can lock without waiting are written along, and are clean afterwards.
+ */
+static int audi_compr_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+	int cluster = page->index / AUDI_CLUSTER_BLOCKS;
+	pgoff_t index = (pgoff_t) cluster * AUDI_CLUSTER_BLOCKS;
+	uint32_t *map = &ai->i_block[cluster * AUDI_CLUSTER_BLOCKS];
+	struct page *pages[AUDI_CLUSTER_BLOCKS] = { NULL };
+	uint32_t bnos[AUDI_CLUSTER_BLOCKS] = { 0 };
+	unsigned long long old = 0, new = 0;
+	struct audi_compr_header *hdr;
+	struct buffer_head *bh;
+	loff_t isize = i_size_read(inode);
+	unsigned int len, dlen;
+	char *buf, *cbuf, *src;
+	int i, nblocks, count, missing = 0, algo, ret;
+
+	/* the page is past the end of the file, it is being truncated. */
+	if (((loff_t) index << PAGE_CACHE_SHIFT) >= isize) {
+		unlock_page(page);
+		return 0;
+	}
+	len = min_t(loff_t, isize - ((loff_t) index << PAGE_CACHE_SHIFT), AUDI_CLUSTER_SIZE);
+	nblocks = DIV_ROUND_UP(len, PAGE_CACHE_SIZE);
+
+	ret = -ENOMEM;
+	buf = kmalloc(AUDI_CLUSTER_SIZE, GFP_NOFS);
+	cbuf = kmalloc(AUDI_COMPR_BUF_SIZE, GFP_NOFS);
+	if (!buf || !cbuf)
+		goto out_free;
+
+	/* what the page cache has. */
+	for (i = 0; i < nblocks; i++) {
+		if (index + i == page->index) {
+			pages[i] = page;
+		} else {
+			pages[i] = find_get_page(page->mapping, index + i);
+			if (pages[i] && !trylock_page(pages[i])) {
+				page_cache_release(pages[i]);
+				pages[i] = NULL;
+			}
+			if (pages[i] && !PageUptodate(pages[i])) {
+				unlock_page(pages[i]);
+				page_cache_release(pages[i]);
+				pages[i] = NULL;
+			}
+			if (pages[i] && !clear_page_dirty_for_io(pages[i]) && PageWriteback(pages[i])) {
+				/* clean, but still on its way to the disk: what we have on disk may be older. */
+				unlock_page(pages[i]);
+				page_cache_release(pages[i]);
+				pages[i] = NULL;
+			}
+		}
+		if (!pages[i]) {
+			missing = 1;
+			continue;
+		}
+		memcpy(buf + i * PAGE_CACHE_SIZE, kmap(pages[i]), PAGE_CACHE_SIZE);
+		kunmap(pages[i]);
+	}
+
+	mutex_lock(&audi_compr_mutex);
+	/* and what the disk has, for the rest. */
+	if (missing) {
+		ret = audi_read_cluster(inode, cluster, cbuf);
+		if (ret)
+			goto out_unlock;
+		for (i = 0; i < nblocks; i++) {
+			if (!pages[i])
+				memcpy(buf + i * PAGE_CACHE_SIZE, cbuf + i * PAGE_CACHE_SIZE, PAGE_CACHE_SIZE);
+		}
+	}
+	/* nothing past the end of the file ever reaches the disk. */
+	memset(buf + len, 0, AUDI_CLUSTER_SIZE - len);
+
+	hdr = (struct audi_compr_header *) cbuf;
+	dlen = AUDI_COMPR_BUF_SIZE - sizeof(*hdr);
+	algo = audi_compr_algo();
+	if (algo && !crypto_comp_compress(audi_compr_tfm[algo], buf, len, cbuf + sizeof(*hdr), &dlen) &&
+		DIV_ROUND_UP(sizeof(*hdr) + dlen, PAGE_CACHE_SIZE) < nblocks) {
+		hdr->c_len = cpu_to_le32(dlen);
+		hdr->c_algo = cpu_to_le32(algo);
+		count = DIV_ROUND_UP(sizeof(*hdr) + dlen, PAGE_CACHE_SIZE);
+		memset(cbuf + sizeof(*hdr) + dlen, 0, count * PAGE_CACHE_SIZE - sizeof(*hdr) - dlen);
+		src = cbuf;
+	} else {
+		count = nblocks;
+		src = buf;
+	}
+
+	ret = -ENOSPC;
+	for (i = 0; i < count; i++) {
+		/* a block of zeroes in a cluster we store as is stays a hole. */
+		if (src == buf && !memchr_inv(buf + i * PAGE_CACHE_SIZE, 0, PAGE_CACHE_SIZE))
+			continue;
+		bnos[i] = get_free_block(AUDI_FS(sb));
+		if (!bnos[i])
+			goto out_put;
+		new |= (1ULL << (63-bnos[i]));
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!bnos[i])
+			continue;
+		bh = sb_getblk(sb, bnos[i]);
+		if (!bh) {
+			ret = -EIO;
+			goto out_put;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data, src + i * PAGE_CACHE_SIZE, PAGE_CACHE_SIZE);
+		set_buffer_uptodate(bh);
+		mark_buffer_dirty(bh);
+		unlock_buffer(bh);
+		ret = sync_dirty_buffer(bh);
+		brelse(bh);
+		if (ret)
+			goto out_put;
+	}
+
+	/* the new blocks are on disk, switch the block map over to them. */
+	for (i = 0; i < AUDI_CLUSTER_BLOCKS; i++) {
+		if (map[i] && map[i] != AUDI_COMPR_ADDR)
+			old |= (1ULL << (63-map[i]));
+		map[i] = 0;
+	}
+	if (src == cbuf) {
+		map[0] = AUDI_COMPR_ADDR;
+		memcpy(&map[1], bnos, count * sizeof(uint32_t));
+	} else {
+		memcpy(map, bnos, count * sizeof(uint32_t));
+	}
+	mark_inode_dirty(inode);
+	if (old)
+		put_blocks(AUDI_FS(sb), old);
+	pr_info("inode %lu: cluster %d, %u bytes in %d blocks\n", inode->i_ino, cluster, len, count);
+	new = 0;
+	ret = 0;
+
+out_put:
+	if (new)
+		put_blocks(AUDI_FS(sb), new);
+out_unlock:
+	mutex_unlock(&audi_compr_mutex);
+out_free:
+	kfree(buf);
+	kfree(cbuf);
+	for (i = 0; i < nblocks; i++) {
+		if (!pages[i] || pages[i] == page)
+			continue;
+		/* these are still dirty then. */
+		if (ret)
+			set_page_dirty(pages[i]);
+		unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+	if (ret) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, ret);
+		unlock_page(page);
+		return ret;
+	}
+	set_page_writeback(page);
+	unlock_page(page);
+	end_page_writeback(page);
+	return 0;
+}
+
+/*
+ * like simple_write_begin(), but a page which is only partly written must first be read,
+ * unless it is completely past the end of the file. blocks are only allocated at writeback.
+ */
+static int audi_compr_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int flags, struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int ret;
+
+	if (pos + len > inode->i_sb->s_maxbytes)
+		return -ENOSPC;
+
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT, flags);
+	if (!page)
+		return -ENOMEM;
+	*pagep = page;
+	if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+		return 0;
+
+	if ((pos & PAGE_CACHE_MASK) >= i_size_read(inode)) {
+		zero_user(page, 0, PAGE_CACHE_SIZE);
+		SetPageUptodate(page);
+		return 0;
+	}
+	ret = audi_compr_read_page(inode, page);
+	if (ret) {
+		unlock_page(page);
+		page_cache_release(page);
+	}
+	return ret;
+}
+
+static int audi_compr_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int copied, struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		/* a whole page write came up short, and the rest of the page was never read: let the caller try again,
+		 * like block_write_end() does. */
+		if (copied < len)
+			copied = 0;
+		else
+			SetPageUptodate(page);
+	}
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	}
+	if (copied)
+		set_page_dirty(page);
+	unlock_page(page);
+	page_cache_release(page);
+	return copied;
+}
+
+const struct address_space_operations audi_compr_aops = {
+	.readpage = audi_compr_readpage,
+	.writepage = audi_compr_writepage,
+	.write_begin = audi_compr_write_begin,
+	.write_end = audi_compr_write_end,
+};
+
+/*
+ * a compressed cluster can not lose some of its blocks, so when the file is shrunk to somewhere inside a cluster,
+ * we dirty the page which will be the new last one, after zeroing what is past newsize in it; writeback then
+ * writes the cluster again, shorter. audi_truncate_blocks() leaves that cluster alone.
+ */
+int audi_compr_truncate_page(struct inode *inode, loff_t newsize)
+{
+	unsigned int offset = newsize & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+
+	if (newsize >= i_size_read(inode) || !(newsize & (AUDI_CLUSTER_SIZE - 1)))
+		return 0;
+
+	page = read_mapping_page(inode->i_mapping, (newsize - 1) >> PAGE_CACHE_SHIFT, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+	if (offset)
+		zero_user_segment(page, offset, PAGE_CACHE_SIZE);
+	set_page_dirty(page);
+	unlock_page(page);
+	page_cache_release(page);
+	return 0;
+}
+
+/* vim: set ts=4: */
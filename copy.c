@@ -0,0 +1,79 @@
+/**
+ * copy.c - copy a file within one audi file system, built as copy.audi.
+ *
+ * unlike cp, the data does not go through userspace: we ask the kernel module to copy the blocks,
+ * with the AUDI_IOC_COPY_RANGE ioctl, see audi_copy_range() in ioctl.c.
+ * with -c, the copy is a clone: it shares the blocks of the source until either file writes to them,
+ * with the AUDI_IOC_CLONE_RANGE ioctl.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "audi.h"
+
+int main(int argc, char **argv)
+{
+    struct audi_copy_range args;
+    struct stat st;
+    unsigned long cmd = AUDI_IOC_COPY_RANGE;
+    int src, dst, opt, ret = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "c")) != -1) {
+        switch (opt) {
+        case 'c':
+            cmd = AUDI_IOC_CLONE_RANGE;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 2) {
+usage:
+        fprintf(stderr, "Usage: %s [-c] source dest\n"
+                "\t-c\tclone: share the blocks of source instead of copying them\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    src = open(argv[optind], O_RDONLY);
+    if (src == -1 || fstat(src, &st)) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    dst = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (dst == -1) {
+        fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+        goto close_src;
+    }
+
+    /* the ioctl does not take an empty range, and there is nothing to copy anyway. */
+    if (st.st_size) {
+        memset(&args, 0, sizeof(args));
+        args.src_fd = src;
+        args.src_length = 0; /* up to the end of the source file */
+        if (ioctl(dst, cmd, &args)) {
+            fprintf(stderr, "%s -> %s: %s\n", argv[optind], argv[optind + 1], strerror(errno));
+            goto close_dst;
+        }
+    }
+    ret = EXIT_SUCCESS;
+
+close_dst:
+    close(dst);
+close_src:
+    close(src);
+    return ret;
+}
+
+/* vim: set ts=4: */
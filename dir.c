@@ -10,16 +10,224 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/mm.h> /* for the shrinker */
 #include <linux/module.h>
+#include <linux/slab.h>
 
 #include "audi.h"
 
+/* all directory indexes, least recently used first, and how many there are. */
+static LIST_HEAD(audi_dir_index_lru);
+static DEFINE_SPINLOCK(audi_dir_index_lock);
+static unsigned long audi_dir_index_count;
+
+static inline unsigned int audi_dir_hash(uint32_t hash)
+{
+	return hash % AUDI_DIR_HASH_BUCKETS;
+}
+
+static void __audi_dir_index_add(struct audi_dir_index *idx, int slot, uint32_t ino, const unsigned char *name, int len)
+{
+	unsigned int b;
+
+	idx->ino[slot] = ino;
+	idx->len[slot] = len;
+	idx->hash[slot] = full_name_hash(name, len);
+	memcpy(idx->name[slot], name, len);
+	b = audi_dir_hash(idx->hash[slot]);
+	idx->next[slot] = idx->buckets[b];
+	idx->buckets[b] = slot;
+}
+
+/* build the index of dir from its dentry table; called by lookup() with the directory block in hand.
+ * the index is optional: if we can not get the memory, we just keep parsing the block. */
+void audi_dir_index_build(struct inode *dir, struct audi_dir_block *dblock)
+{
+	struct audi_inode_info *ci = AUDI_INODE(dir);
+	struct audi_dir_index *idx;
+	struct audi_dir_entry *de;
+	int i;
+
+	if (ci->dir_index)
+		return;
+	idx = kmem_cache_zalloc(audi_dir_index_cachep, GFP_NOFS);
+	if (!idx)
+		return;
+	for (i = 2; i < audi_dir_slots(dir); i++) {
+		de = &dblock->entries[i];
+		if (de->inode)
+			__audi_dir_index_add(idx, i, de->inode, de->name, strnlen(de->name, AUDI_FILENAME_LEN));
+	}
+	idx->dir = dir;
+	ci->dir_index = idx;
+
+	spin_lock(&audi_dir_index_lock);
+	list_add_tail(&idx->lru, &audi_dir_index_lru);
+	audi_dir_index_count++;
+	spin_unlock(&audi_dir_index_lock);
+}
+
+/* return the inode number of name in dir, or 0 if it is not there. the caller checked dir has an index. */
+uint32_t audi_dir_index_find(struct inode *dir, const unsigned char *name, int len)
+{
+	struct audi_dir_index *idx = AUDI_INODE(dir)->dir_index;
+	uint32_t hash = full_name_hash(name, len);
+	int slot;
+
+	/* a hot directory moves to the end of the lru list, so the shrinker frees it last. */
+	spin_lock(&audi_dir_index_lock);
+	list_move_tail(&idx->lru, &audi_dir_index_lru);
+	spin_unlock(&audi_dir_index_lock);
+
+	for (slot = idx->buckets[audi_dir_hash(hash)]; slot; slot = idx->next[slot]) {
+		if (idx->hash[slot] == hash && idx->len[slot] == len && !memcmp(idx->name[slot], name, len))
+			return idx->ino[slot];
+	}
+	return 0;
+}
+
+/* create() just put a new entry into slot. */
+void audi_dir_index_add(struct inode *dir, int slot, uint32_t ino, const unsigned char *name, int len)
+{
+	struct audi_dir_index *idx = AUDI_INODE(dir)->dir_index;
+
+	if (idx)
+		__audi_dir_index_add(idx, slot, ino, name, len);
+}
+
+/* unlink() just cleared slot. */
+void audi_dir_index_del(struct inode *dir, int slot)
+{
+	struct audi_dir_index *idx = AUDI_INODE(dir)->dir_index;
+	unsigned char *p;
+
+	if (!idx || !idx->ino[slot])
+		return;
+	for (p = &idx->buckets[audi_dir_hash(idx->hash[slot])]; *p; p = &idx->next[*p]) {
+		if (*p == slot) {
+			*p = idx->next[slot];
+			break;
+		}
+	}
+	idx->ino[slot] = 0;
+}
+
+/* called when the inode is destroyed. */
+void audi_dir_index_free(struct inode *dir)
+{
+	struct audi_inode_info *ci = AUDI_INODE(dir);
+	struct audi_dir_index *idx;
+
+	spin_lock(&audi_dir_index_lock);
+	idx = ci->dir_index;
+	if (idx) {
+		list_del(&idx->lru);
+		audi_dir_index_count--;
+		ci->dir_index = NULL;
+	}
+	spin_unlock(&audi_dir_index_lock);
+	if (idx)
+		kmem_cache_free(audi_dir_index_cachep, idx);
+}
+
+/* every change to a directory block goes through here: with metadata checksums, the checksum kept in the
+ * directory's inode follows the block. the caller marks the directory's inode dirty, so audi_write_inode()
+ * writes the new checksum out. */
+void audi_dir_block_dirty(struct inode *dir, struct buffer_head *bh)
+{
+	struct audi_sb_info *sbi = AUDI_SB(dir->i_sb);
+
+	if (audi_has_csum(sbi))
+		AUDI_INODE(dir)->i_dir_checksum = audi_crc32c(AUDI_CRC32C_SEED, bh->b_data, bh->b_size);
+	mark_buffer_dirty(bh);
+}
+
+/* return 0 if the directory block does not match the checksum in the directory's inode. */
+int audi_dir_block_verify(struct inode *dir, struct buffer_head *bh)
+{
+	struct audi_sb_info *sbi = AUDI_SB(dir->i_sb);
+
+	if (!audi_has_csum(sbi))
+		return 1;
+	if (audi_crc32c(AUDI_CRC32C_SEED, bh->b_data, bh->b_size) == AUDI_INODE(dir)->i_dir_checksum)
+		return 1;
+	pr_info("directory %lu: checksum mismatch in block %u\n", dir->i_ino, AUDI_INODE(dir)->i_block[0]);
+	return 0;
+}
+
+static unsigned long audi_dir_index_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	return audi_dir_index_count;
+}
+
+/* free up to nr_to_scan indexes, oldest first. an index is only used with its directory's i_mutex held,
+ * so we skip the directories we can not lock right now: someone is using their index. */
+static unsigned long audi_dir_index_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct audi_dir_index *idx, *tmp;
+	unsigned long nr = sc->nr_to_scan, freed = 0;
+	struct inode *dir;
+	LIST_HEAD(dispose);
+
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	spin_lock(&audi_dir_index_lock);
+	while (nr-- && !list_empty(&audi_dir_index_lru)) {
+		idx = list_first_entry(&audi_dir_index_lru, struct audi_dir_index, lru);
+		dir = idx->dir;
+		if (!mutex_trylock(&dir->i_mutex)) {
+			list_move_tail(&idx->lru, &audi_dir_index_lru);
+			continue;
+		}
+		AUDI_INODE(dir)->dir_index = NULL;
+		mutex_unlock(&dir->i_mutex);
+		list_move(&idx->lru, &dispose);
+		audi_dir_index_count--;
+	}
+	spin_unlock(&audi_dir_index_lock);
+
+	list_for_each_entry_safe(idx, tmp, &dispose, lru) {
+		kmem_cache_free(audi_dir_index_cachep, idx);
+		freed++;
+	}
+	return freed;
+}
+
+struct shrinker audi_dir_index_shrinker = {
+	.count_objects = audi_dir_index_shrink_count,
+	.scan_objects = audi_dir_index_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static int audi_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 	pr_info("so they call this read dir...\n");
 	return 0;
 }
 
+/* "ls -l" calls stat() on every entry right after readdir, and each audi_iget() of an inode which is not cached
+ * yet does a blocking sb_bread() of its inode table block. so while we emit the entries, we start reading
+ * the inode table blocks of the entries from slot start onwards, once per block: 16 inodes share a 4KB block. */
+static void audi_itable_readahead(struct super_block *sb, struct audi_dir_block *dblock, int start)
+{
+	struct audi_sb_info *sbi = AUDI_SB(sb);
+	unsigned long issued = 0; /* bit n set: we already issued inode table block n */
+	uint32_t ino, block;
+	int i;
+
+	for (i = start; i < AUDI_DIR_SLOTS(sb->s_blocksize); i++) {
+		ino = dblock->entries[i].inode;
+		if (!ino || ino >= sbi->s_inodes_count)
+			continue;
+		block = ino / AUDI_INODES_PER_BLOCK(sb->s_blocksize);
+		if (issued & (1UL << block))
+			continue;
+		issued |= (1UL << block);
+		sb_breadahead(sb, block + 3); /* inode table starts at block 3 */
+	}
+}
+
 /*
  * when we run the "ls" command, without any argument, this function will be called.
  * more specifically, this function is called by the readdir() system call - which will then call getdents().
@@ -39,6 +247,10 @@ static int audi_readdir(struct file *filp, void *dirent, filldir_t filldir)
  * };
  * note, here pos is just an integer; when pos is 0, it is indicating ".", 
  * when pos is 1, it is indicating "..".
+ * pos is our readdir cookie: it is the index of the next slot in the dentry table.
+ * unlink() and create() never move an entry to another slot, so a cookie stays valid
+ * across a getdents() batch, or a telldir()/seekdir(), no matter what happens in between;
+ * and resuming at pos costs nothing, we do not rescan the slots before it.
  */
 static int audi_iterate(struct file *dir, struct dir_context *ctx)
 {
@@ -59,7 +271,7 @@ static int audi_iterate(struct file *dir, struct dir_context *ctx)
 	 * check that ctx->pos is not bigger than what we can handle (including
 	 * . and ..)
 	 */
-	if (ctx->pos > AUDI_MAX_SUBFILES)
+	if (ctx->pos >= audi_dir_slots(inode))
 		return 0;
 
 	/* commit . and .. to ctx; this line guarantees that no matter what, 
@@ -71,16 +283,19 @@ static int audi_iterate(struct file *dir, struct dir_context *ctx)
 
 	pr_info("read dir...and ctx->pos is then %d\n", (int)ctx->pos);
 	/* read the directory index block from disk */
-	bh = sb_bread(sb, ci->data_block);
+	bh = sb_bread(sb, ci->i_block[0]);
 	if (!bh)
 		return -EIO;
+	if (!audi_dir_block_verify(inode, bh)) {
+		brelse(bh);
+		return -EIO;
+	}
 	dblock = (struct audi_dir_block *) bh->b_data;
+	audi_itable_readahead(sb, dblock, ctx->pos);
 
-	/* iterate over the index block and commit subfiles */
-	for (i = ctx->pos; i < AUDI_MAX_SUBFILES; i++) {
+	/* iterate over the index block and commit subfiles, skipping the free slots. */
+	for (i = ctx->pos; i < audi_dir_slots(inode); i++) {
 		audi_dentry = &dblock->entries[i];
-		if (!audi_dentry->inode)
-			break;
 	/* dir_emit() is defined in include/linux/fs.h as following:
 	 * static inline bool dir_emit(struct dir_context *ctx, const char *name, int namelen, u64 ino, unsigned type)
 	 * {
@@ -89,10 +304,12 @@ static int audi_iterate(struct file *dir, struct dir_context *ctx)
 	 * it seems this actor() is either filldir() (if users call getdents()) or filldir64() (if users call getdents64()), both defined in fs/readdir.c.
 	 * so if we assume users call getdents(), then this dir_emit() will actually call filldir(), which will fill one dentry into ctx, 
 	 * and then with for loop, we can fill in all valid dentries into ctx.
+	 * when the user buffer is full, dir_emit() fails and we stop; ctx->pos still points at this slot, so the next call resumes here.
 	 */
-		if (!dir_emit(ctx, audi_dentry->name, AUDI_FILENAME_LEN, audi_dentry->inode, DT_UNKNOWN))
+		if (audi_dentry->inode &&
+			!dir_emit(ctx, audi_dentry->name, strnlen(audi_dentry->name, AUDI_FILENAME_LEN), audi_dentry->inode, DT_UNKNOWN))
 			break;
-		ctx->pos++;
+		ctx->pos = i + 1;
 	}
 
 	/* again, everytime we call sb_bread, once the result is used, we call brelse to decrement the reference count. */
@@ -102,10 +319,24 @@ static int audi_iterate(struct file *dir, struct dir_context *ctx)
 	return 0;
 }
 
+/* start reading the directory's blocks without waiting for them. sb_breadahead() does nothing
+ * if the block is already in the buffer cache, so this is cheap for hot directories.
+ * a directory is one block in this file system, so there is exactly one block to read ahead. */
+static void audi_dir_readahead(struct inode *inode)
+{
+	struct audi_inode_info *ci = AUDI_INODE(inode);
+
+	if (ci->i_block[0])
+		sb_breadahead(inode->i_sb, ci->i_block[0]);
+}
+
 static int audi_dir_open(struct inode *inode, struct file *file)
 {
 	/* let the kernel safely know that iterate is present */
 	file->f_mode |= FMODE_KABI_ITERATE;
+	/* "ls" and "find" do open(), then fstat() and friends, then getdents();
+	 * by the time audi_iterate() calls sb_bread(), the block is already on its way. */
+	audi_dir_readahead(inode);
 	return 0;
 }
 
@@ -116,6 +347,7 @@ const struct file_operations audi_dir_ops = {
 	.iterate	= audi_iterate,
 	.readdir	= audi_readdir, /* on CentOS 7, they check this readdir; but on newer OS, it seems they check iterate. so it's either readdir, or iterate. */
 	.fsync	= generic_file_fsync,
+	.unlocked_ioctl	= audi_ioctl, /* FITRIM, e.g., "fstrim test" */
 };
 
 /* vim: set ts=4: */
@@ -11,6 +11,7 @@
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
 
+#include "bitmap.h"
 #include "audi.h"
 
 /*
@@ -27,10 +28,22 @@ static int audi_file_get_block(struct inode *inode, sector_t iblock, struct buff
 
 	printk(KERN_WARNING "calling audi file get block...\n");
 	/* if block number exceeds filesize, fail */
-	if (iblock >= AUDI_MAX_BLOCKS)
+	if (iblock >= AUDI_N_BLOCKS)
 		return -EFBIG;
 
-	bno = ai->data_block;
+	bno = ai->i_block[iblock];
+	if (!bno) {
+		/* not allocated: when reading, leave bh_result unmapped and the page cache fills it with zeroes. */
+		if (!create)
+			return 0;
+		bno = get_free_block(AUDI_FS(sb));
+		if (!bno)
+			return -ENOSPC;
+		ai->i_block[iblock] = bno;
+		mark_inode_dirty(inode);
+		/* tell block_write_begin() the block has garbage in it, so it zeroes what the write does not cover. */
+		set_buffer_new(bh_result);
+	}
 
 	/* map the physical block to the given buffer_head */
 	map_bh(bh_result, sb, bno);
@@ -38,6 +51,120 @@ static int audi_file_get_block(struct inode *inode, sector_t iblock, struct buff
 	return ret;
 }
 
+/*
+ * take the blocks which hold nothing but bytes past size out of the block map, and drop our references to them.
+ * return the blocks which are now unused, in the bit order of the data bitmap; the caller gives them back with put_blocks().
+ * the caller takes care of i_size and of the page cache.
+ */
+unsigned long long audi_drop_blocks(struct inode *inode, loff_t size)
+{
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+	unsigned long long blocks = 0;
+	int i = DIV_ROUND_UP(size, inode->i_sb->s_blocksize);
+
+	/* a compressed cluster goes as a whole or not at all, see audi_compr_truncate_page(). */
+	if (audi_compressed(inode) && i < AUDI_N_BLOCKS &&
+		ai->i_block[round_down(i, AUDI_CLUSTER_BLOCKS)] == AUDI_COMPR_ADDR)
+		i = round_up(i, AUDI_CLUSTER_BLOCKS);
+	for (; i < AUDI_N_BLOCKS; i++) {
+		if (!ai->i_block[i])
+			continue;
+		/* a block shared with another file stays in use. */
+		if (ai->i_block[i] != AUDI_COMPR_ADDR && put_block_ref(AUDI_FS(inode->i_sb), ai->i_block[i]))
+			blocks |= (1ULL << (63-ai->i_block[i]));
+		ai->i_block[i] = 0;
+		mark_inode_dirty(inode);
+	}
+	return blocks;
+}
+
+/* free the blocks past size: the blocks go back to the allocator all at once, see put_blocks(). */
+void audi_truncate_blocks(struct inode *inode, loff_t size)
+{
+	unsigned long long blocks = audi_drop_blocks(inode, size);
+
+	if (blocks)
+		put_blocks(AUDI_FS(inode->i_sb), blocks);
+}
+
+/*
+ * copy-on-write: a block of page index of inode is shared with another file (see AUDI_REFCOUNT_OFFSET in audi.h),
+ * and we are about to modify the page. give the file blocks of its own, which get the shared data:
+ * we read the page from the shared blocks, point the block map at new blocks, and dirty the page,
+ * so writeback writes the whole page into the new blocks. the shared blocks themselves are never written.
+ * the page stays dirty, so it can not be dropped, until it is in the new blocks.
+ * a page holds PAGE_CACHE_SIZE / blocksize blocks, every shared one among them is unshared.
+ */
+static int audi_unshare_page(struct inode *inode, pgoff_t index)
+{
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+	struct audi_fs_info *fsi = AUDI_FS(inode->i_sb);
+	struct buffer_head *bh, *head;
+	struct page *page;
+	unsigned int per_page = 1 << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+	unsigned int first = index * per_page;
+	unsigned int last = min_t(unsigned int, first + per_page, AUDI_N_BLOCKS);
+	uint32_t new_bno[AUDI_N_BLOCKS] = { 0 };
+	unsigned long long freed = 0;
+	int i, ret = 0;
+
+	/* only a hint, the reference counts are looked at again under s_bitmap_lock by put_block_ref(). */
+	for (i = first; i < last; i++)
+		if (ai->i_block[i] && fsi->s_data_refcount[ai->i_block[i]])
+			break;
+	if (i >= last)
+		return 0;
+
+	page = read_mapping_page(inode->i_mapping, index, NULL);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	lock_page(page);
+
+	/* get all the new blocks first: if we run out, the block map and the page stay as they were,
+	 * and the shared blocks are not written. */
+	for (; i < last; i++) {
+		if (!ai->i_block[i] || !fsi->s_data_refcount[ai->i_block[i]])
+			continue;
+		new_bno[i] = get_free_block(fsi);
+		if (!new_bno[i]) {
+			ret = -ENOSPC;
+			goto out_free;
+		}
+	}
+
+	for (i = first; i < last; i++) {
+		if (!new_bno[i])
+			continue;
+		/* the other owners may have let go of the block since we looked, then it is ours to free. */
+		if (put_block_ref(fsi, ai->i_block[i]))
+			freed |= (1ULL << (63-ai->i_block[i]));
+		ai->i_block[i] = new_bno[i];
+	}
+	mark_inode_dirty(inode);
+
+	/* buffers still mapped to the shared blocks get mapped again by audi_file_get_block(). */
+	if (page_has_buffers(page)) {
+		bh = head = page_buffers(page);
+		do {
+			clear_buffer_mapped(bh);
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	set_page_dirty(page);
+	goto out;
+
+out_free:
+	for (i = first; i < last; i++)
+		if (new_bno[i])
+			freed |= (1ULL << (63-new_bno[i]));
+out:
+	if (freed)
+		put_blocks(fsi, freed);
+	unlock_page(page);
+	page_cache_release(page);
+	return ret;
+}
+
 /*
  * called by the page cache to read a page from the physical disk and map it in
  * memory.
@@ -65,44 +192,41 @@ static int audi_writepage(struct page *page, struct writeback_control *wbc)
  */
 static int audi_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int flags, struct page **pagep, void **fsdata)
 {
+    struct inode *inode = mapping->host;
     int err;
 
 	printk(KERN_WARNING "calling audi write begin...\n");
     /* Check if the write can be completed (enough space?) */
-    if (pos + len > AUDI_MAX_FILESIZE)
+    if (pos + len > inode->i_sb->s_maxbytes)
         return -ENOSPC;
 
+    /* a shared block is never written in place. */
+    err = audi_unshare_page(inode, pos >> PAGE_CACHE_SHIFT);
+    if (err)
+        return err;
+
     /* prepare the write */
     err = block_write_begin(mapping, pos, len, flags, pagep, audi_file_get_block);
-    /* if this failed, reclaim newly allocated blocks */
-    if (err < 0)
-        printk(KERN_WARNING "newly allocated blocks reclaim not implemented yet\n");
+    /* if this failed, reclaim newly allocated blocks past the end of the file, like ext2_write_failed() */
+    if (err < 0 && pos + len > inode->i_size) {
+        truncate_inode_pages(mapping, inode->i_size);
+        audi_truncate_blocks(inode, inode->i_size);
+    }
     return err;
 }
 
 /*
  * called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * cache. generic_write_end() updates i_size, and dirties the inode, only when the file grows;
+ * the times are not our business here: generic_file_aio_write() calls file_update_time() once per write(),
+ * and that dirties the inode only when mtime/ctime actually change at s_time_gran.
+ * so small appends within the same second (or overwrites) do not keep writing the inode table.
  */
 static int audi_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len, unsigned int copied, struct page *page, void *fsdata)
 {
-    struct inode *inode = file->f_inode;
-	int ret;
-
 	printk(KERN_WARNING "calling audi write end...\n");
     /* complete the write() */
-    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-    if (ret < len) {
-        printk(KERN_WARNING "wrote less than requested.");
-        return ret;
-    }
-
-    /* update inode metadata */
-    inode->i_mtime = inode->i_ctime = CURRENT_TIME;
-    mark_inode_dirty(inode);
-
-    return ret;
+    return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
 }
 
 const struct address_space_operations audi_aops = {
@@ -112,20 +236,170 @@ const struct address_space_operations audi_aops = {
 	.write_end = audi_write_end,
 };
 
+/*
+ * change the size of a regular file, this is what truncate(), ftruncate() and open() with O_TRUNC end up in.
+ * mimicking ext2_setsize(): zero the tail of the last block, which stays in the file,
+ * drop the page cache past the new size, and then free the blocks which are now completely past it.
+ * growing a file needs no block at all: the part past the old size is a hole, and reads as zeroes.
+ */
+static int audi_setsize(struct inode *inode, loff_t newsize)
+{
+	int ret;
+
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+
+	if (audi_compressed(inode)) {
+		ret = audi_compr_truncate_page(inode, newsize);
+		if (ret)
+			return ret;
+	} else {
+		/* block_truncate_page() zeroes the tail of the last block, which must not be a shared one. */
+		if (newsize & (inode->i_sb->s_blocksize - 1)) {
+			ret = audi_unshare_page(inode, newsize >> PAGE_CACHE_SHIFT);
+			if (ret)
+				return ret;
+		}
+		ret = block_truncate_page(inode->i_mapping, newsize, audi_file_get_block);
+		if (ret)
+			return ret;
+	}
+
+	truncate_setsize(inode, newsize);
+	audi_truncate_blocks(inode, newsize);
+	inode->i_mtime = inode->i_ctime = current_fs_time(inode->i_sb);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+static int audi_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = dentry->d_inode;
+	int ret;
+
+	/* permission checks, and for a size change, s_maxbytes. */
+	ret = inode_change_ok(inode, iattr);
+	if (ret)
+		return ret;
+
+	if ((iattr->ia_valid & ATTR_SIZE) && iattr->ia_size != i_size_read(inode)) {
+		ret = audi_setsize(inode, iattr->ia_size);
+		if (ret)
+			return ret;
+	}
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* report where the blocks of the file are, holes are simply not reported.
+ * the blocks of a compressed file do not map to the file one to one, so we do not report those. */
+static int audi_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	if (audi_compressed(inode))
+		return -EOPNOTSUPP;
+	return generic_block_fiemap(inode, fieinfo, start, len, audi_file_get_block);
+}
+
 const struct inode_operations audi_file_inode_ops = {
+	.setattr = audi_setattr,
 	.getattr = simple_getattr,
+	.fiemap = audi_fiemap,
 };
 
+/*
+ * find the next data (SEEK_DATA) or the next hole (SEEK_HOLE) at or after offset.
+ * a block is data if the block map points to it: blocks are allocated in write_begin, before any data
+ * goes into the page cache, so the block map is never behind. the end of the file counts as a hole.
+ * the caller holds i_mutex, so the block map does not change under us.
+ * a compressed file only gets its blocks at writeback, so the caller writes it back first; all of a compressed
+ * cluster is data, even though only its first entries are set.
+ */
+static loff_t audi_seek_hole_data(struct inode *inode, loff_t offset, int whence)
+{
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+	loff_t isize = i_size_read(inode);
+	loff_t pos;
+	int i;
+
+	if (offset < 0 || offset >= isize)
+		return -ENXIO;
+
+	for (i = offset >> inode->i_blkbits; i < AUDI_N_BLOCKS; i++) {
+		pos = max_t(loff_t, offset, (loff_t) i << inode->i_blkbits);
+		if (pos >= isize)
+			break;
+		if ((whence == SEEK_DATA) == (ai->i_block[i] != 0 ||
+				ai->i_block[round_down(i, AUDI_CLUSTER_BLOCKS)] == AUDI_COMPR_ADDR))
+			return pos;
+	}
+	return (whence == SEEK_DATA) ? -ENXIO : isize;
+}
+
+static loff_t audi_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file->f_mapping->host;
+
+	switch (whence) {
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		mutex_lock(&inode->i_mutex);
+		if (audi_compressed(inode))
+			filemap_write_and_wait(inode->i_mapping);
+		offset = audi_seek_hole_data(inode, offset, whence);
+		mutex_unlock(&inode->i_mutex);
+		if (offset < 0)
+			return offset;
+		return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+	default:
+		/* SEEK_SET, SEEK_CUR and SEEK_END do not care about holes. */
+		return generic_file_llseek(file, offset, whence);
+	}
+}
+
+/* a write fault on a page of a mmap()ed file: give it a block of its own, or any block at all if it is a hole. */
+static int audi_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	int ret;
+
+	/* a compressed file gets its blocks at writeback, the page only has to be dirtied. */
+	if (audi_compressed(inode))
+		return filemap_page_mkwrite(vma, vmf);
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vma->vm_file);
+	ret = audi_unshare_page(inode, vmf->page->index);
+	if (!ret)
+		ret = block_page_mkwrite(vma, vmf, audi_file_get_block);
+	sb_end_pagefault(inode->i_sb);
+	return block_page_mkwrite_return(ret);
+}
+
+static const struct vm_operations_struct audi_file_vm_ops = {
+	.fault = filemap_fault,
+	.page_mkwrite = audi_page_mkwrite,
+	.remap_pages = generic_file_remap_pages,
+};
+
+/* like generic_file_mmap(), but with our own page_mkwrite, see audi_unshare_page(). */
+static int audi_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &audi_file_vm_ops;
+	return 0;
+}
+
 const struct file_operations audi_file_ops = {
 	.read = do_sync_read,
 	.aio_read = generic_file_aio_read,
 	.write = do_sync_write,
 	.aio_write = generic_file_aio_write,
-	.mmap = generic_file_mmap,
+	.mmap = audi_file_mmap,
 	.fsync = noop_fsync,
 	.splice_read = generic_file_splice_read,
 	.splice_write = generic_file_splice_write,
-	.llseek = generic_file_llseek,
+	.llseek = audi_file_llseek,
+	.unlocked_ioctl = audi_ioctl,
 };
 
 /* vim: set ts=4: */
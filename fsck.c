@@ -0,0 +1,673 @@
+/**
+ * fsck.c - check and repair an audi image, built as fsck.audi.
+ *
+ * the image is mmap'ed through libaudi. the checker runs in phases:
+ *   1. superblock,
+ *   2. inode table: worker threads scan the inode table blocks in parallel,
+ *      then blocks used by more than one inode are handed out in inode order,
+ *   3. directories: worker threads walk the tree from the root, each worker
+ *      has its own queue of directories and steals from the others when it runs dry,
+ *   4. link counts,
+ *   5. bitmaps and free counts in the superblock.
+ * on an image with metadata checksums, each phase also checks the checksums of what it reads;
+ * once every problem found is fixed, all of them are recomputed when the image is synced, see audi_image_sync().
+ * otherwise none is: what we could not fix keeps its bad checksum, and the next run still finds it.
+ * the wall-clock time of each phase is reported at the end.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libaudi.h"
+
+/* exit codes, same as e2fsck */
+#define FSCK_OK 0
+#define FSCK_NONDESTRUCT 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define FSCK_MAX_THREADS 64
+/* blocks below this one are the superblock, the two bitmaps and the inode table. */
+#define AUDI_FIRST_DATA_BLOCK (AUDI_INODE_TABLE_BLOCK_NR + AUDI_INODE_BLOCKS)
+/* the bitmaps are 64 bits, so that's how many inodes and blocks we can track. */
+#define AUDI_BITMAP_BITS 64
+
+/* what we learn about each inode. */
+struct fsck_inode {
+    uint32_t mode;      /* 0 if the inode is not in use, or is broken */
+    uint32_t block;     /* for directories: its data block */
+    uint64_t blocks;    /* all of its data blocks, same bit order as the data bitmap */
+    int refs;           /* number of directory entries (other than . and ..) pointing at it */
+    int subdirs;        /* for directories: number of sub directories */
+    int parent;         /* for directories: who links to it */
+    int visited;        /* for directories: already queued by the walk */
+    int orphan;         /* on the orphan list, see s_last_orphan in audi.h */
+};
+
+/* a directory queue owned by one worker, other workers steal from its head. */
+struct fsck_queue {
+    pthread_mutex_t lock;
+    uint32_t items[AUDI_BITMAP_BITS];
+    int head, tail;
+};
+
+struct fsck {
+    struct audi_image img;
+    int repair;
+    int nr_threads;
+    uint32_t nr_inodes;
+    uint32_t itable_initialized;
+    struct fsck_inode inodes[AUDI_BITMAP_BITS];
+    pthread_mutex_t lock;    /* protects the counters below */
+    int errors;
+    int fixed;
+
+    /* inode table scan */
+    int next_itable_block;
+
+    /* directory walk */
+    struct fsck_queue queues[FSCK_MAX_THREADS];
+    int pending;             /* directories queued or being processed, the walk is done when it drops to 0 */
+};
+
+struct fsck_worker {
+    struct fsck *fs;
+    int id;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline uint64_t fsck_bit(uint32_t nr)
+{
+    return 1ULL << (63 - nr);
+}
+
+/* report a problem; return 1 if we are allowed to fix it. */
+static int problem(struct fsck *fs, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int problem(struct fsck *fs, const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&fs->lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    fs->errors++;
+    if (fs->repair) {
+        fs->fixed++;
+        printf(" - fixed\n");
+    } else {
+        printf("\n");
+    }
+    pthread_mutex_unlock(&fs->lock);
+    return fs->repair;
+}
+
+/*
+ * phase 1: superblock.
+ */
+static int check_super(struct fsck *fs)
+{
+    struct audi_sb_info *sb = fs->img.sb;
+    uint32_t blocks = le32toh(sb->s_blocks_count);
+
+    if (le32toh(sb->s_features) & ~AUDI_FEATURE_ALL) {
+        fprintf(stderr, "superblock: unknown features 0x%x\n", le32toh(sb->s_features) & ~AUDI_FEATURE_ALL);
+        return -1;
+    }
+    if (audi_has_csum(sb) && le32toh(sb->s_checksum) != audi_sb_checksum(sb))
+        problem(fs, "superblock: checksum mismatch");
+    fs->nr_inodes = le32toh(sb->s_inodes_count);
+    if (fs->nr_inodes > AUDI_INODES_PER_BLOCK(fs->img.block_size) * AUDI_INODE_BLOCKS) {
+        fprintf(stderr, "superblock: bad inode count %u\n", fs->nr_inodes);
+        return -1;
+    }
+    if (le32toh(sb->s_itable_unused) > fs->nr_inodes &&
+        problem(fs, "superblock: %u unused inodes, but only %u inodes", le32toh(sb->s_itable_unused), fs->nr_inodes))
+        sb->s_itable_unused = 0;
+    fs->itable_initialized = audi_image_itable_initialized(&fs->img);
+    /* inodes past the bitmap can never be allocated. */
+    if (fs->nr_inodes > AUDI_BITMAP_BITS)
+        fs->nr_inodes = AUDI_BITMAP_BITS;
+    if (blocks != fs->img.nr_blocks &&
+        problem(fs, "superblock: block count %u, but the image has %u blocks", blocks, fs->img.nr_blocks))
+        sb->s_blocks_count = htole32(fs->img.nr_blocks);
+    return 0;
+}
+
+/*
+ * phase 2: inode table. each worker grabs one inode table block at a time.
+ */
+static int bad_block(struct fsck *fs, uint32_t bno)
+{
+    return bno < AUDI_FIRST_DATA_BLOCK || bno >= fs->img.nr_blocks || bno >= AUDI_BITMAP_BITS;
+}
+
+static void scan_inode(struct fsck *fs, uint32_t ino)
+{
+    struct audi_inode *inode = audi_image_inode(&fs->img, ino);
+    struct fsck_inode *fi = &fs->inodes[ino];
+    uint32_t mode = le32toh(inode->i_mode);
+    uint32_t bno = le32toh(inode->i_block[0]);
+    uint64_t blocks = 0;
+    int i;
+
+    if (!audi_image_inode_used(&fs->img, ino))
+        return;
+    /* the lazily initialized part of the inode table holds garbage, nothing there can be in use. */
+    if (ino >= fs->itable_initialized) {
+        problem(fs, "inode %u: in use, but past the initialized part of the inode table", ino);
+        return;
+    }
+    if (audi_has_csum(fs->img.sb) && le32toh(inode->i_checksum) != audi_inode_checksum(ino, inode))
+        problem(fs, "inode %u: checksum mismatch", ino);
+    if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
+        /* leave mode at 0: the directory walk will drop the entries pointing here, and phase 5 frees it. */
+        problem(fs, "inode %u: bad mode 0%o", ino, mode);
+        return;
+    }
+    if (!S_ISREG(mode) && (le32toh(inode->i_flags) & AUDI_COMPR_FL) &&
+        problem(fs, "inode %u: compression flag on something other than a regular file", ino))
+        inode->i_flags &= ~htole32(AUDI_COMPR_FL);
+    if (audi_has_inode_v2(fs->img.sb) &&
+        (le32toh(inode->i_ctime_nsec) >= 1000000000 || le32toh(inode->i_atime_nsec) >= 1000000000 ||
+         le32toh(inode->i_mtime_nsec) >= 1000000000) &&
+        problem(fs, "inode %u: bad nanoseconds in the timestamps", ino))
+        inode->i_ctime_nsec = inode->i_atime_nsec = inode->i_mtime_nsec = 0;
+    /* fast symlinks keep their target in the inode, and have no data block. */
+    if (S_ISLNK(mode) && audi_inode_size(fs->img.sb, inode) < AUDI_FAST_SYMLINK_LEN) {
+        for (i = 0; i < AUDI_N_BLOCKS; i++) {
+            bno = le32toh(inode->i_block[i]);
+            if (bno && problem(fs, "inode %u: fast symlink with data block %u", ino, bno))
+                inode->i_block[i] = 0;
+        }
+        fi->mode = mode;
+        return;
+    }
+    /* a directory is exactly one block, without it there is nothing to check. */
+    if (S_ISDIR(mode) && bad_block(fs, bno)) {
+        problem(fs, "inode %u: bad data block %u", ino, bno);
+        return;
+    }
+    if (!S_ISDIR(mode) && audi_inode_size(fs->img.sb, inode) > AUDI_MAX_FILESIZE(fs->img.block_size) &&
+        problem(fs, "inode %u: size %" PRIu64 " is too big", ino, audi_inode_size(fs->img.sb, inode)))
+        audi_inode_set_size(fs->img.sb, inode, AUDI_MAX_FILESIZE(fs->img.block_size));
+
+    /* the block map of a file may have holes; a bad pointer becomes a hole. */
+    for (i = 0; i < AUDI_N_BLOCKS; i++) {
+        bno = le32toh(inode->i_block[i]);
+        if (!bno)
+            continue;
+        /* the first entry of a compressed cluster is a marker, not a block, see AUDI_COMPR_ADDR in audi.h. */
+        if (bno == AUDI_COMPR_ADDR && (le32toh(inode->i_flags) & AUDI_COMPR_FL) && i % AUDI_CLUSTER_BLOCKS == 0)
+            continue;
+        if (S_ISDIR(mode) && i > 0) {
+            if (problem(fs, "inode %u: directory with more than one block", ino))
+                inode->i_block[i] = 0;
+            continue;
+        }
+        if (bad_block(fs, bno)) {
+            if (problem(fs, "inode %u: bad data block %u", ino, bno))
+                inode->i_block[i] = 0;
+            continue;
+        }
+        /* who gets a block used by more than one inode is decided by claim_blocks(), once all inodes are in. */
+        blocks |= fsck_bit(bno);
+    }
+
+    fi->mode = mode;
+    fi->block = le32toh(inode->i_block[0]);
+    fi->blocks = blocks;
+}
+
+static void *itable_worker(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck *fs = w->fs;
+    uint32_t ino, first;
+    int block;
+
+    while ((block = __atomic_fetch_add(&fs->next_itable_block, 1, __ATOMIC_RELAXED)) < AUDI_INODE_BLOCKS) {
+        first = block * AUDI_INODES_PER_BLOCK(fs->img.block_size);
+        for (ino = first; ino < first + AUDI_INODES_PER_BLOCK(fs->img.block_size) && ino < fs->nr_inodes; ino++)
+            if (ino)
+                scan_inode(fs, ino);
+    }
+    return NULL;
+}
+
+/*
+ * end of phase 2, single threaded: files may share blocks (reflinks, the reference counts are checked in phase 5),
+ * but nothing may share a block with a directory. directories claim their block first, then files, both in inode
+ * order, so a conflict is resolved the same way whatever order the workers scanned the inodes in.
+ */
+static void claim_blocks(struct fsck *fs)
+{
+    struct audi_inode *inode;
+    struct fsck_inode *fi;
+    uint64_t dir_blocks = 0, bit;
+    uint32_t ino, bno;
+    int i;
+
+    for (ino = 0; ino < fs->nr_inodes; ino++) {
+        fi = &fs->inodes[ino];
+        if (!S_ISDIR(fi->mode))
+            continue;
+        if (dir_blocks & fi->blocks) {
+            /* leave mode at 0, like a directory without a block in scan_inode(). */
+            problem(fs, "inode %u: data block %u is used by another inode", ino, fi->block);
+            fi->mode = 0;
+            fi->blocks = 0;
+            continue;
+        }
+        dir_blocks |= fi->blocks;
+    }
+    for (ino = 0; ino < fs->nr_inodes; ino++) {
+        fi = &fs->inodes[ino];
+        if (!fi->mode || S_ISDIR(fi->mode) || !(fi->blocks & dir_blocks))
+            continue;
+        inode = audi_image_inode(&fs->img, ino);
+        for (i = 0; i < AUDI_N_BLOCKS; i++) {
+            bno = le32toh(inode->i_block[i]);
+            if (bno >= AUDI_BITMAP_BITS)
+                continue;
+            bit = fsck_bit(bno);
+            if ((fi->blocks & bit) && (dir_blocks & bit) &&
+                problem(fs, "inode %u: data block %u is used by another inode", ino, bno))
+                inode->i_block[i] = 0;
+        }
+        fi->blocks &= ~dir_blocks;
+    }
+}
+
+/*
+ * phase 3: directory walk, with one queue per worker and work stealing.
+ */
+static void queue_push(struct fsck *fs, int id, uint32_t ino)
+{
+    struct fsck_queue *q = &fs->queues[id];
+
+    __atomic_add_fetch(&fs->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&q->lock);
+    /* each directory is queued at most once, so the ring never overflows. */
+    q->items[q->tail++ % AUDI_BITMAP_BITS] = ino;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* the owner pops the newest item (depth first, better locality), thieves take the oldest one. */
+static int queue_pop(struct fsck *fs, int id, uint32_t *ino)
+{
+    struct fsck_queue *q;
+    int i, victim;
+
+    q = &fs->queues[id];
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail) {
+        *ino = q->items[--q->tail % AUDI_BITMAP_BITS];
+        pthread_mutex_unlock(&q->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 1; i < fs->nr_threads; i++) {
+        victim = (id + i) % fs->nr_threads;
+        q = &fs->queues[victim];
+        pthread_mutex_lock(&q->lock);
+        if (q->head != q->tail) {
+            *ino = q->items[q->head++ % AUDI_BITMAP_BITS];
+            pthread_mutex_unlock(&q->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 0;
+}
+
+static void clear_entry(struct audi_dir_entry *de)
+{
+    memset(de, 0, sizeof(*de));
+}
+
+static void check_dir(struct fsck *fs, int id, uint32_t dir)
+{
+    struct audi_dir_block *dblock = audi_image_block(&fs->img, fs->inodes[dir].block);
+    struct audi_dir_entry *de;
+    struct fsck_inode *child;
+    uint32_t ino, dotdot;
+    int i;
+
+    if (audi_has_csum(fs->img.sb) &&
+        le32toh(audi_image_inode(&fs->img, dir)->i_dir_checksum) != audi_crc32c(AUDI_CRC32C_SEED, dblock, fs->img.block_size))
+        problem(fs, "directory %u: checksum mismatch", dir);
+    de = &dblock->entries[0];
+    if ((le32toh(de->inode) != dir || strcmp(de->name, ".")) &&
+        problem(fs, "directory %u: bad \".\" entry", dir)) {
+        de->inode = htole32(dir);
+        strcpy(de->name, ".");
+    }
+    de = &dblock->entries[1];
+    /* mkfs and audi_iget() set the root's ".." to -1. */
+    dotdot = (dir == AUDI_ROOT_INO) ? (uint32_t) -1 : (uint32_t) fs->inodes[dir].parent;
+    if (le32toh(de->inode) != dotdot && !(dir == AUDI_ROOT_INO && le32toh(de->inode) == dir)) {
+        if (problem(fs, "directory %u: \"..\" is %u, should be %u", dir, le32toh(de->inode), dotdot))
+            de->inode = htole32(dotdot);
+    }
+    if (strcmp(de->name, "..") && problem(fs, "directory %u: bad \"..\" entry name", dir))
+        strcpy(de->name, "..");
+
+    for (i = 2; i < AUDI_DIR_SLOTS(fs->img.block_size); i++) {
+        de = &dblock->entries[i];
+        ino = le32toh(de->inode);
+        if (!ino)
+            continue;
+        if (ino >= fs->nr_inodes || !fs->inodes[ino].mode) {
+            if (problem(fs, "directory %u: entry %d points to bad inode %u", dir, i, ino))
+                clear_entry(de);
+            continue;
+        }
+        if (!de->name[0]) {
+            if (problem(fs, "directory %u: entry %d has a bad name", dir, i))
+                clear_entry(de);
+            continue;
+        }
+        child = &fs->inodes[ino];
+        if (S_ISDIR(child->mode)) {
+            /* directories can not be hard linked, and the root can not be anyone's child. */
+            if (ino == AUDI_ROOT_INO ||
+                __atomic_exchange_n(&child->visited, 1, __ATOMIC_SEQ_CST)) {
+                if (problem(fs, "directory %u: entry %d is a second link to directory %u", dir, i, ino))
+                    clear_entry(de);
+                continue;
+            }
+            child->parent = dir;
+            __atomic_add_fetch(&fs->inodes[dir].subdirs, 1, __ATOMIC_RELAXED);
+            queue_push(fs, id, ino);
+        }
+        __atomic_add_fetch(&child->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *dir_worker(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck *fs = w->fs;
+    uint32_t dir;
+
+    while (__atomic_load_n(&fs->pending, __ATOMIC_SEQ_CST) > 0) {
+        if (!queue_pop(fs, w->id, &dir)) {
+            sched_yield();
+            continue;
+        }
+        check_dir(fs, w->id, dir);
+        __atomic_sub_fetch(&fs->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static int run_workers(struct fsck *fs, void *(*fn)(void *))
+{
+    pthread_t threads[FSCK_MAX_THREADS];
+    struct fsck_worker workers[FSCK_MAX_THREADS];
+    int i, ret;
+
+    for (i = 0; i < fs->nr_threads; i++) {
+        workers[i].fs = fs;
+        workers[i].id = i;
+        ret = pthread_create(&threads[i], NULL, fn, &workers[i]);
+        if (ret) {
+            fprintf(stderr, "pthread_create(): %s\n", strerror(ret));
+            fs->nr_threads = i;
+            break;
+        }
+    }
+    for (i = 0; i < fs->nr_threads; i++)
+        pthread_join(threads[i], NULL);
+    return fs->nr_threads ? 0 : -1;
+}
+
+static int check_root(struct fsck *fs)
+{
+    if (!S_ISDIR(fs->inodes[AUDI_ROOT_INO].mode)) {
+        fprintf(stderr, "root inode is not a directory, run mkfs.audi\n");
+        return -1;
+    }
+    fs->inodes[AUDI_ROOT_INO].visited = 1;
+    queue_push(fs, 0, AUDI_ROOT_INO);
+    return 0;
+}
+
+/*
+ * the orphan list: inodes which were unlinked while open. they are in use, without any entry or link,
+ * until the kernel frees them at the next mount. the list is cut short at the first inode which does not belong.
+ */
+static void check_orphans(struct fsck *fs)
+{
+    struct audi_sb_info *sb = fs->img.sb;
+    uint32_t *link = &sb->s_last_orphan;
+    uint32_t ino;
+
+    while ((ino = le32toh(*link))) {
+        if (ino >= fs->nr_inodes || !fs->inodes[ino].mode || fs->inodes[ino].orphan || fs->inodes[ino].refs ||
+            le32toh(audi_image_inode(&fs->img, ino)->i_nlink)) {
+            if (problem(fs, "orphan list: inode %u does not belong there", ino))
+                *link = 0;
+            return;
+        }
+        fs->inodes[ino].orphan = 1;
+        link = &audi_image_inode(&fs->img, ino)->i_next_orphan;
+    }
+}
+
+/*
+ * phase 4: link counts. regular files and symlinks have one link per entry,
+ * directories have 2 (. and ..) plus one per sub directory.
+ */
+static void check_links(struct fsck *fs)
+{
+    struct audi_inode *inode;
+    struct fsck_inode *fi;
+    uint32_t ino, expected;
+
+    check_orphans(fs);
+    for (ino = 1; ino < fs->nr_inodes; ino++) {
+        fi = &fs->inodes[ino];
+        if (!fi->mode)
+            continue;
+        /* unreachable inodes are released in phase 5. */
+        if (ino != AUDI_ROOT_INO && !fi->refs)
+            continue;
+        inode = audi_image_inode(&fs->img, ino);
+        expected = S_ISDIR(fi->mode) ? 2 + fi->subdirs : fi->refs;
+        if (le32toh(inode->i_nlink) != expected &&
+            problem(fs, "inode %u: link count is %u, should be %u", ino, le32toh(inode->i_nlink), expected))
+            inode->i_nlink = htole32(expected);
+    }
+}
+
+/*
+ * phase 5: rebuild the bitmaps and the block reference counts from what is reachable, and fix the free counts.
+ */
+static void check_bitmaps(struct fsck *fs)
+{
+    struct audi_sb_info *sb = fs->img.sb;
+    struct audi_inode *inode;
+    uint64_t imap = fsck_bit(0), dmap = 0, old;
+    uint32_t ino, bno, free_inodes, free_blocks;
+    int refs[AUDI_BITMAP_BITS] = { 0 };
+    int i, expected;
+
+    if (audi_has_csum(sb) &&
+        le32toh(sb->s_inode_bitmap_csum) != audi_crc32c(AUDI_CRC32C_SEED, fs->img.inode_bitmap, AUDI_INODE_BITMAP_CSUM_LEN))
+        problem(fs, "inode bitmap: checksum mismatch");
+    if (audi_has_csum(sb) &&
+        le32toh(sb->s_data_bitmap_csum) != audi_crc32c(AUDI_CRC32C_SEED, fs->img.data_bitmap, AUDI_DATA_BITMAP_CSUM_LEN))
+        problem(fs, "data bitmap: checksum mismatch");
+    for (bno = 0; bno < AUDI_FIRST_DATA_BLOCK; bno++)
+        dmap |= fsck_bit(bno);
+    /* blocks past the end of the image are never free. */
+    for (bno = fs->img.nr_blocks; bno < AUDI_BITMAP_BITS; bno++)
+        dmap |= fsck_bit(bno);
+    for (ino = 1; ino < fs->nr_inodes; ino++) {
+        if (!fs->inodes[ino].mode)
+            continue;
+        if (ino != AUDI_ROOT_INO && !fs->inodes[ino].refs && !fs->inodes[ino].orphan) {
+            problem(fs, "inode %u is not linked from any directory", ino);
+            continue;
+        }
+        imap |= fsck_bit(ino);
+        dmap |= fs->inodes[ino].blocks;
+        /* count block map entries, not blocks: one file may map the same block twice. */
+        inode = audi_image_inode(&fs->img, ino);
+        for (i = 0; i < AUDI_N_BLOCKS; i++) {
+            bno = le32toh(inode->i_block[i]);
+            if (bno && bno < AUDI_BITMAP_BITS && (fs->inodes[ino].blocks & fsck_bit(bno)))
+                refs[bno]++;
+        }
+    }
+
+    for (bno = AUDI_FIRST_DATA_BLOCK; bno < AUDI_MAX_BLOCKS; bno++) {
+        expected = refs[bno] ? refs[bno] - 1 : 0;
+        if (expected > AUDI_MAX_REFCOUNT)
+            expected = AUDI_MAX_REFCOUNT;
+        if (fs->img.data_refcount[bno] != expected &&
+            problem(fs, "block %u: reference count is %u, should be %d", bno, fs->img.data_refcount[bno] + 1, expected + 1))
+            fs->img.data_refcount[bno] = expected;
+    }
+
+    old = le64toh(*fs->img.inode_bitmap);
+    if (old != imap && problem(fs, "inode bitmap is 0x%llx, should be 0x%llx",
+                               (unsigned long long) old, (unsigned long long) imap))
+        *fs->img.inode_bitmap = htole64(imap);
+    old = le64toh(*fs->img.data_bitmap);
+    if (old != dmap && problem(fs, "data bitmap is 0x%llx, should be 0x%llx",
+                               (unsigned long long) old, (unsigned long long) dmap))
+        *fs->img.data_bitmap = htole64(dmap);
+
+    /* same accounting as get_free_inode() and get_free_block(): inode 0 and the reserved blocks count as used. */
+    free_inodes = le32toh(sb->s_inodes_count) - __builtin_popcountll(imap);
+    free_blocks = AUDI_BITMAP_BITS - __builtin_popcountll(dmap);
+    if (le32toh(sb->s_free_inodes_count) != free_inodes &&
+        problem(fs, "superblock: %u free inodes, should be %u", le32toh(sb->s_free_inodes_count), free_inodes))
+        sb->s_free_inodes_count = htole32(free_inodes);
+    if (le32toh(sb->s_free_blocks_count) != free_blocks &&
+        problem(fs, "superblock: %u free blocks, should be %u", le32toh(sb->s_free_blocks_count), free_blocks))
+        sb->s_free_blocks_count = htole32(free_blocks);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n] [-y] [-j threads] disk\n"
+            "\t-n\tcheck only, do not change anything (default)\n"
+            "\t-y\trepair the problems we find\n"
+            "\t-j\tnumber of worker threads (default: number of cpus)\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    static struct fsck fs;
+    double t[6];
+    uint32_t ino;
+    int opt, i, ret;
+
+    fs.nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            fs.repair = 0;
+            break;
+        case 'y':
+            fs.repair = 1;
+            break;
+        case 'j':
+            fs.nr_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+    if (fs.nr_threads < 1)
+        fs.nr_threads = 1;
+    if (fs.nr_threads > FSCK_MAX_THREADS)
+        fs.nr_threads = FSCK_MAX_THREADS;
+
+    pthread_mutex_init(&fs.lock, NULL);
+    for (i = 0; i < FSCK_MAX_THREADS; i++)
+        pthread_mutex_init(&fs.queues[i].lock, NULL);
+
+    ret = audi_image_open(&fs.img, argv[optind], fs.repair);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+        return FSCK_ERROR;
+    }
+
+    t[0] = now();
+    if (check_super(&fs)) {
+        ret = FSCK_ERROR;
+        goto out;
+    }
+    t[1] = now();
+    if (run_workers(&fs, itable_worker)) {
+        ret = FSCK_ERROR;
+        goto out;
+    }
+    claim_blocks(&fs);
+    t[2] = now();
+    if (check_root(&fs) || run_workers(&fs, dir_worker)) {
+        ret = FSCK_ERROR;
+        goto out;
+    }
+    t[3] = now();
+    check_links(&fs);
+    t[4] = now();
+    check_bitmaps(&fs);
+    t[5] = now();
+
+    printf("%s: %d problem(s) found, %d fixed\n", argv[optind], fs.errors, fs.fixed);
+    printf("phase 1 (superblock):   %10.6f s\n", t[1] - t[0]);
+    printf("phase 2 (inode table):  %10.6f s (%d threads)\n", t[2] - t[1], fs.nr_threads);
+    printf("phase 3 (directories):  %10.6f s (%d threads)\n", t[3] - t[2], fs.nr_threads);
+    printf("phase 4 (link counts):  %10.6f s\n", t[4] - t[3]);
+    printf("phase 5 (bitmaps):      %10.6f s\n", t[5] - t[4]);
+
+    if (!fs.errors)
+        ret = FSCK_OK;
+    else if (fs.fixed == fs.errors)
+        ret = FSCK_NONDESTRUCT;
+    else
+        ret = FSCK_UNCORRECTED;
+    if (ret == FSCK_NONDESTRUCT) {
+        for (ino = 0; ino < fs.nr_inodes; ino++)
+            audi_image_dirty_inode(&fs.img, ino);
+        audi_image_dirty_super(&fs.img);
+    }
+out:
+    audi_image_close(&fs.img);
+    return ret;
+}
+
+/* vim: set ts=4: */
@@ -26,9 +26,9 @@ struct inode *audi_iget(struct super_block *sb, unsigned long ino)
 	 * according to the book chapter, it must be between block 3 and block 7.
 	 * block 0 for super block, block 1 for inode bitmap, block 2 for data bitmap.
 	 * block 8 to 63 for data blocks. */
-	uint32_t inode_block = (ino / AUDI_INODES_PER_BLOCK) + 3; /* inode table is located at block 3 */
-	uint32_t inode_shift = ino % AUDI_INODES_PER_BLOCK;
-	int ret;
+	uint32_t inode_block = (ino / AUDI_INODES_PER_BLOCK(sb->s_blocksize)) + 3; /* inode table is located at block 3 */
+	uint32_t inode_shift = ino % AUDI_INODES_PER_BLOCK(sb->s_blocksize);
+	int i, ret;
 
 	/* Fail if ino is out of range */
 	if (ino >= sbi->s_inodes_count) // we can have at most 80 inodes.
@@ -63,43 +63,75 @@ struct inode *audi_iget(struct super_block *sb, unsigned long ino)
 	ainode = (struct audi_inode *) bh->b_data;
 	ainode += inode_shift;
 
+	/* an inode which was never written is all zeroes, there is no checksum to check yet. */
+	if (audi_has_csum(sbi) && memchr_inv(ainode, 0, sizeof(*ainode)) &&
+		ainode->i_checksum != audi_inode_checksum(ino, ainode)) {
+		pr_info("inode %lu: checksum mismatch\n", ino);
+		brelse(bh);
+		ret = -EIO;
+		goto failed;
+	}
+
 	inode->i_sb = sb;
 
 	inode->i_ino = ino;
 	inode->i_mode = le32_to_cpu(ainode->i_mode);
 	i_uid_write(inode, le32_to_cpu(ainode->i_uid));
 	i_gid_write(inode, le32_to_cpu(ainode->i_gid));
-	inode->i_size = le32_to_cpu(ainode->i_size);
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
+	inode->i_size = audi_inode_size(sbi, ainode);
+	/* the times on the disk, not the time of this iget(): make, rsync and friends compare them across remounts. */
+	inode->i_ctime.tv_sec = (signed) le32_to_cpu(ainode->i_ctime);
+	inode->i_atime.tv_sec = (signed) le32_to_cpu(ainode->i_atime);
+	inode->i_mtime.tv_sec = (signed) le32_to_cpu(ainode->i_mtime);
+	if (audi_has_inode_v2(sbi)) {
+		inode->i_ctime.tv_nsec = le32_to_cpu(ainode->i_ctime_nsec);
+		inode->i_atime.tv_nsec = le32_to_cpu(ainode->i_atime_nsec);
+		inode->i_mtime.tv_nsec = le32_to_cpu(ainode->i_mtime_nsec);
+	} else {
+		inode->i_ctime.tv_nsec = inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = 0;
+	}
 	inode->i_mapping->a_ops = &audi_aops;
 	pr_info("register audi_aops\n");
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_op = &audi_dir_inode_ops;
 		inode->i_fop = &audi_dir_ops;
 		pr_info("register audi_dir_ops\n");
-
-		/* directory inodes start off with i_nlink == 2,
-		 * for directory, i_nlink means how many sub directories this directory has,
-		 * by default it's 2, representing "." and "..".*/
-		inc_nlink(inode);
 	}else if(S_ISREG(inode->i_mode)){
 		inode->i_op = &audi_file_inode_ops;
 		inode->i_fop = &audi_file_ops;
 		pr_info("register audi_file_ops\n");
+	}else if(S_ISLNK(inode->i_mode)){
+		if (inode->i_size < AUDI_FAST_SYMLINK_LEN) {
+			inode->i_op = &audi_fast_symlink_inode_ops;
+			memcpy(AUDI_INODE(inode)->i_symlink, ainode->i_symlink, AUDI_FAST_SYMLINK_LEN);
+			AUDI_INODE(inode)->i_symlink[AUDI_FAST_SYMLINK_LEN - 1] = '\0';
+		} else {
+			inode->i_op = &audi_symlink_inode_ops;
+		}
 	}
+	/* for a directory, i_nlink is 2 (. and ..) plus one for each sub directory's "..";
+	 * for everything else, it is the number of directory entries pointing to this inode. */
+	set_nlink(inode, le32_to_cpu(ainode->i_nlink));
 
 	/* see how alloc_inode() works: we allocate memory for a struct audi_inode, 
 	 * but the VFS uses struct inode; so getting one from the other is frequently happening. */
 	ai = AUDI_INODE(inode);
-	/* struct inode is more generic, it doesn't track data_block, which is a pointer, 
-	 * but struct audi_inode does track, because this pointer is file system specific,
-	 * not every file system has such a pointer. */
-	ai->data_block = le32_to_cpu(ainode->data_block);
+	/* struct inode is more generic, it doesn't track i_block, which is an array of pointers, 
+	 * but struct audi_inode does track, because these pointers are file system specific,
+	 * not every file system has such pointers. */
+	for (i = 0; i < AUDI_N_BLOCKS; i++)
+		ai->i_block[i] = le32_to_cpu(ainode->i_block[i]);
+	ai->i_flags = le32_to_cpu(ainode->i_flags);
+	ai->i_dir_checksum = le32_to_cpu(ainode->i_dir_checksum);
+	ai->i_next_orphan = le32_to_cpu(ainode->i_next_orphan);
+	/* a compressed file does its own I/O, see compress.c. */
+	if (S_ISREG(inode->i_mode) && audi_compressed(inode))
+		inode->i_mapping->a_ops = &audi_compr_aops;
 	if(ino == AUDI_ROOT_INO){
-		if(!(bh2 = sb_bread(sb, ai->data_block))){
+		if(!(bh2 = sb_bread(sb, ai->i_block[0]))){
         	return ERR_PTR(-EIO);
 		}
-		pr_info("audi_iget: reading block %d\n", ai->data_block);
+		pr_info("audi_iget: reading block %d\n", ai->i_block[0]);
     	dblock = (struct audi_dir_block *) bh2->b_data;
 		dblock->entries[0].inode = ino;
 		dblock->entries[0].name[0]='.';
@@ -126,6 +158,39 @@ failed:
 	return ERR_PTR(ret);
 }
 
+/* mkfs only initializes the first block of the inode table, see s_itable_unused in audi.h.
+ * before we hand out inode ino, make sure the inode table block holding it has been zeroed.
+ * we never read these blocks, their old content is garbage: sb_getblk() just gives us a buffer
+ * for the block, we zero it and let the writeback write it out. the caller holds s_itable_mutex. */
+static int audi_init_itable(struct super_block *sb, uint32_t ino)
+{
+	struct audi_sb_info *sbi = AUDI_SB(sb);
+	struct buffer_head *bh;
+	uint32_t initialized = sbi->s_inodes_count - sbi->s_itable_unused;
+	uint32_t inode_block;
+
+	while (ino >= initialized) {
+		inode_block = (initialized / AUDI_INODES_PER_BLOCK(sb->s_blocksize)) + 3; /* inode table starts at block 3 */
+		pr_info("initializing inode table block %d\n", inode_block);
+		bh = sb_getblk(sb, inode_block);
+		if (!bh)
+			return -EIO;
+		lock_buffer(bh);
+		memset(bh->b_data, 0, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		brelse(bh);
+
+		initialized = (initialized / AUDI_INODES_PER_BLOCK(sb->s_blocksize) + 1) * AUDI_INODES_PER_BLOCK(sb->s_blocksize);
+		if (initialized > sbi->s_inodes_count)
+			initialized = sbi->s_inodes_count;
+		/* the superblock goes to disk in audi_sync_fs(). */
+		sbi->s_itable_unused = sbi->s_inodes_count - initialized;
+	}
+	return 0;
+}
+
 /* create a new inode in dir */
 static struct inode *audi_new_inode(struct inode *dir, mode_t mode)
 {
@@ -140,10 +205,10 @@ static struct inode *audi_new_inode(struct inode *dir, mode_t mode)
     int ret;
 
     /* check mode before doing anything to avoid undoing everything */
-    if (!S_ISDIR(mode) && !S_ISREG(mode) ) {
+    if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
         pr_err(
-            "File type not supported (only directory and regular file "
-            "supported)\n");
+            "File type not supported (only directory, regular file "
+            "and symlink supported)\n");
         return ERR_PTR(-EINVAL);
     }
 
@@ -152,17 +217,28 @@ static struct inode *audi_new_inode(struct inode *dir, mode_t mode)
     sb = dir->i_sb;
 	/* from a generic struct super_block to our struct audi_sb_info */
     sbi = AUDI_SB(sb);
-	/* report error if all inodes or all blocks are used. */
-    if (sbi->s_free_inodes_count == 0 || sbi->s_free_blocks_count == 0)
+	/* report error if all inodes are used, or if a directory can not get its block. */
+    if (sbi->s_free_inodes_count == 0 || (sbi->s_free_blocks_count == 0 && S_ISDIR(mode)))
         return ERR_PTR(-ENOSPC);
 
-    /* get a new free inode */
-    ino = get_free_inode(sbi);
+    /* get a new free inode, next to the parent in the inode table if we can,
+     * or else next to the last inode created in the same directory. */
+    /* s_itable_mutex keeps the next creator from getting an inode in a block we have not zeroed yet,
+     * or from zeroing it again once our inode is in there. */
+    mutex_lock(&AUDI_FS(sb)->s_itable_mutex);
+    ino = get_free_inode(AUDI_FS(sb), dir->i_ino, AUDI_INODE(dir)->i_alloc_hint);
 	/* ino 0 means invalid, thus if we get 0, we can't allocate an inode */
-    if (!ino)
+    if (!ino) {
+        mutex_unlock(&AUDI_FS(sb)->s_itable_mutex);
         return ERR_PTR(-ENOSPC);
+    }
+    AUDI_INODE(dir)->i_alloc_hint = ino;
 
-    pr_info("new inode: we ask for inode %u, and current inode bitmap is %llx\n", ino, inode_bitmap);
+    pr_info("new inode: we ask for inode %u, and current inode bitmap is %llx\n", ino, AUDI_FS(sb)->s_inode_bitmap);
+    ret = audi_init_itable(sb, ino);
+    mutex_unlock(&AUDI_FS(sb)->s_itable_mutex);
+    if (ret)
+        goto put_ino;
     inode = audi_iget(sb, ino);
     if (IS_ERR(inode)) {
         ret = PTR_ERR(inode);
@@ -171,23 +247,42 @@ static struct inode *audi_new_inode(struct inode *dir, mode_t mode)
 
     ai = AUDI_INODE(inode);
 
-    /* get a free block for this new inode's index */
-	/* FIXME: do we really need to do this when the newly created file is just an empty file? 
-	 * although such a problem isn't a real problem in real life - it's not common to create empty files in real life... */
-    bno = get_free_block(sbi);
+    memset(ai->i_block, 0, sizeof(ai->i_block));
+    ai->i_flags = 0;
+    /* initialize inode, this function just initializes uid, gid, mode for new inode according to posix standards */
+	/* for regular inodes, we call this inode_init_owner in audi_new_inode(),
+	 * for root inode, we call this inode_init_owner in audi_fill_super().*/
+	/* we already initialized inode's uid, gid, mode in the above iget() function, but here we set them again if needed. */
+    inode_init_owner(inode, dir, mode);
+	inode->i_ctime = inode->i_atime = inode->i_mtime = current_fs_time(sb);
+
+	/* regular files and symlinks start out without any block,
+	 * audi_file_get_block() allocates them one at a time, as they are written. */
+    if (!S_ISDIR(mode)) {
+		inode->i_size = 0;
+		if (S_ISREG(mode)) {
+			inode->i_op = &audi_file_inode_ops;
+			inode->i_fop = &audi_file_ops;
+			pr_info("register audi_file_ops\n");
+			if (test_opt(sb, COMPRESS)) {
+				ai->i_flags |= AUDI_COMPR_FL;
+				inode->i_mapping->a_ops = &audi_compr_aops;
+			}
+		}
+		set_nlink(inode, 1);
+		return inode;
+    }
+
+    /* get a free block for the new directory's dentry table */
+    bno = get_free_block(AUDI_FS(sb));
     if (!bno) {
         ret = -ENOSPC;
         goto put_inode;
     }
-	/* question: we just updated inode_bitmap and data_bitmap in memory, but how do we write it back to disk? 
+	/* question: we just updated the inode bitmap and the data bitmap in memory, but how do we write it back to disk? 
 	 * answer: we do so in audi_sync_fs(), which at least will get called when we unmount the file system. */
 
-    pr_info("new inode, we ask for block %u, and current data bitmap is %llx\n", bno, data_bitmap);
-    /* initialize inode, this function just initializes uid, gid, mode for new inode according to posix standards */
-	/* for regular inodes, we call this inode_init_owner in audi_new_inode(),
-	 * for root inode, we call this inode_init_owner in audi_fill_super().*/
-	/* we already initialized inode's uid, gid, mode in the above iget() function, but here we set them again if needed. */
-    inode_init_owner(inode, dir, mode);
+    pr_info("new inode, we ask for block %u, and current data bitmap is %llx\n", bno, AUDI_FS(sb)->s_data_bitmap);
 	if(!(bh = sb_bread(sb, bno))){
        	return ERR_PTR(-EIO);
 	}
@@ -195,55 +290,181 @@ static struct inode *audi_new_inode(struct inode *dir, mode_t mode)
    	dblock = (struct audi_dir_block *) bh->b_data;
    	block = (char *) dblock;
 	/* zero out the block so as to clear old data */
-   	memset(block, 0, AUDI_BLOCK_SIZE);
-    if (S_ISDIR(mode)) {
-		/* we don't just set data_block here, but we also really write the block's first two entries. */
-		ai->data_block = bno;
-		dblock->entries[0].inode = ino;
-		dblock->entries[0].name[0]='.';
-		dblock->entries[0].name[1]='\0';
-		dblock->entries[1].inode = dir->i_ino; // question: is this number correct? or do we care?
-		dblock->entries[1].name[0]='.';
-		dblock->entries[1].name[1]='.';
-		dblock->entries[1].name[2]='\0';
-		pr_info("entries[0].inode is %d, entries[1].inode is %d\n", dblock->entries[0].inode, dblock->entries[1].inode);
-
-		inode->i_size = AUDI_BLOCK_SIZE;
-		inode->i_op = &audi_dir_inode_ops;
-		inode->i_fop = &audi_dir_ops;
-		set_nlink(inode, 2); /* . and .. */
-		pr_info("register audi_dir_ops\n");
-    } else if (S_ISREG(mode)) {
-		ai->data_block = bno;
-		inode->i_size = 0;
-		inode->i_op = &audi_file_inode_ops;
-		inode->i_fop = &audi_file_ops;
-		pr_info("register audi_file_ops\n");
-		inode->i_mapping->a_ops = &audi_aops;
-		pr_info("register audi_aops\n");
-		set_nlink(inode, 1);
-    }
-   	mark_buffer_dirty(bh);
+   	memset(block, 0, bh->b_size);
+	/* we don't just set i_block[0] here, but we also really write the block's first two entries. */
+	ai->i_block[0] = bno;
+	dblock->entries[0].inode = ino;
+	dblock->entries[0].name[0]='.';
+	dblock->entries[0].name[1]='\0';
+	dblock->entries[1].inode = dir->i_ino; // question: is this number correct? or do we care?
+	dblock->entries[1].name[0]='.';
+	dblock->entries[1].name[1]='.';
+	dblock->entries[1].name[2]='\0';
+	pr_info("entries[0].inode is %d, entries[1].inode is %d\n", dblock->entries[0].inode, dblock->entries[1].inode);
+
+	inode->i_size = sb->s_blocksize;
+	inode->i_op = &audi_dir_inode_ops;
+	inode->i_fop = &audi_dir_ops;
+	set_nlink(inode, 2); /* . and .. */
+	pr_info("register audi_dir_ops\n");
+	audi_dir_block_dirty(inode, bh);
+	mark_inode_dirty(inode);
 	/* after sb_bread, once the information is obtained, we always need to call brelse. */
 	brelse(bh);
 
-	inode->i_ctime = inode->i_atime = inode->i_mtime = CURRENT_TIME;
 	return inode;
 
 put_inode:
-	/* update data bitmap to mark this data block is free. */
-    put_block(AUDI_SB(sb), AUDI_INODE(inode)->data_block);
-    /* update inode bitmap to mark this inode is free. */
-    put_inode(AUDI_SB(sb), inode->i_ino);
-	/* dropping an inode's usage count. if the inode's use count hits
-	 * zero, the inode is then freed and may also be destroyed. iput() is defined in fs/inode.c. */
+	/* no block was allocated yet. dropping an inode's usage count. if the inode's use count hits
+	 * zero, the inode is then freed and may also be destroyed. iput() is defined in fs/inode.c.
+	 * without any link, audi_evict_inode() gives the inode number back. */
+	clear_nlink(inode);
 	iput(inode);
+	return ERR_PTR(ret);
 put_ino:
     /* update inode bitmap to mark this inode is free. */
-	put_inode(sbi, ino);
+	put_inode(AUDI_FS(sb), ino);
 	return ERR_PTR(ret);
 }
 
+/*
+ * the orphan list, see s_last_orphan in audi.h. on the disk it is a chain of inode numbers, from s_last_orphan
+ * through i_next_orphan; s_orphans in struct audi_fs_info holds the same inodes in the same order, so when an inode
+ * leaves the list we know who points at it. every inode on the list is in memory: someone still has it open.
+ */
+
+/* inode just lost its last name: it goes to the front of the list until audi_evict_inode() frees it. */
+static void audi_orphan_add(struct inode *inode)
+{
+	struct audi_fs_info *fsi = AUDI_FS(inode->i_sb);
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+
+	mutex_lock(&fsi->s_orphan_mutex);
+	if (list_empty(&ai->i_orphan)) {
+		ai->i_next_orphan = fsi->s_sbi->s_last_orphan;
+		fsi->s_sbi->s_last_orphan = inode->i_ino;
+		list_add(&ai->i_orphan, &fsi->s_orphans);
+	}
+	mutex_unlock(&fsi->s_orphan_mutex);
+	/* the superblock goes to disk in audi_sync_fs(). */
+	mark_inode_dirty(inode);
+}
+
+static void audi_orphan_del(struct inode *inode)
+{
+	struct audi_fs_info *fsi = AUDI_FS(inode->i_sb);
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+	struct audi_inode_info *prev;
+
+	mutex_lock(&fsi->s_orphan_mutex);
+	if (!list_empty(&ai->i_orphan)) {
+		if (ai->i_orphan.prev == &fsi->s_orphans) {
+			fsi->s_sbi->s_last_orphan = ai->i_next_orphan;
+		} else {
+			prev = list_entry(ai->i_orphan.prev, struct audi_inode_info, i_orphan);
+			prev->i_next_orphan = ai->i_next_orphan;
+			mark_inode_dirty(&prev->vfs_inode);
+		}
+		list_del_init(&ai->i_orphan);
+		ai->i_next_orphan = 0;
+	}
+	mutex_unlock(&fsi->s_orphan_mutex);
+}
+
+/*
+ * called at mount time: free whatever is left on the orphan list, i.e., inodes which were unlinked while open
+ * when we crashed. this only looks at the inodes on the list, it does not scan the inode table.
+ * each one is read, put on s_orphans, and let go of: audi_evict_inode() does the rest.
+ */
+void audi_orphan_cleanup(struct super_block *sb)
+{
+	struct audi_fs_info *fsi = AUDI_FS(sb);
+	struct audi_sb_info *sbi = fsi->s_sbi;
+	struct inode *inode;
+	uint32_t ino, n = 0;
+
+	while ((ino = sbi->s_last_orphan)) {
+		/* a list longer than the inode table has a loop in it. */
+		if (n++ >= sbi->s_inodes_count) {
+			pr_info("orphan list: too long, dropping the rest\n");
+			sbi->s_last_orphan = 0;
+			break;
+		}
+		inode = audi_iget(sb, ino);
+		if (IS_ERR(inode)) {
+			pr_info("orphan list: can not read inode %u, dropping the rest\n", ino);
+			sbi->s_last_orphan = 0;
+			break;
+		}
+		mutex_lock(&fsi->s_orphan_mutex);
+		list_add(&AUDI_INODE(inode)->i_orphan, &fsi->s_orphans);
+		mutex_unlock(&fsi->s_orphan_mutex);
+		/* a name still points at it, it does not belong here. */
+		if (inode->i_nlink) {
+			pr_info("orphan list: inode %u still has %u links\n", ino, inode->i_nlink);
+			audi_orphan_del(inode);
+			mark_inode_dirty(inode);
+		}
+		pr_info("orphan list: freeing inode %u\n", ino);
+		iput(inode);
+	}
+}
+
+/*
+ * take the data blocks and the inode number away from an inode which has no names left, and which nobody has open,
+ * and take it off the orphan list. the blocks and the inode which are now free are added to *blocks and *inodes,
+ * the caller gives them back with put_blocks() and put_inodes(), and writes the inode:
+ * audi_evict_inode() does that for one inode, audi_reclaim() for a whole batch.
+ */
+void audi_release_inode(struct inode *inode, unsigned long long *blocks, unsigned long long *inodes)
+{
+	/* no need to zero out the data blocks: a new directory block is cleared by audi_new_inode(),
+	 * a new file block is buffer_new() so the page cache never reads its old content, and holes are not mapped. */
+	/* the page cache must not write anything back into blocks which may soon belong to someone else. */
+	truncate_inode_pages(&inode->i_data, 0);
+	*blocks |= audi_drop_blocks(inode, 0);
+	inode->i_size = 0;
+	audi_orphan_del(inode);
+	*inodes |= (1ULL << (63-inode->i_ino));
+}
+
+/*
+ * insert an entry for inode, called dentry, into the first free slot of the parent directory's dentry table,
+ * and update the parent's times. return -EMLINK if the parent directory is already full.
+ * like ext2_add_link(), this is shared by create(), link() and symlink().
+ */
+static int audi_add_link(struct inode *dir, struct dentry *dentry, struct inode *inode)
+{
+	struct buffer_head *bh;
+	struct audi_dir_block *dblock;
+	int i;
+
+	/* read the parent's dentry table, and find its first free slot. */
+	bh = sb_bread(dir->i_sb, AUDI_INODE(dir)->i_block[0]);
+	if (!bh)
+		return -EIO;
+	dblock = (struct audi_dir_block *) bh->b_data;
+	for (i = 2; i < audi_dir_slots(dir); i++) {
+		if (!dblock->entries[i].inode)
+			break;
+	}
+	if (i == audi_dir_slots(dir)) {
+		brelse(bh);
+		return -EMLINK;
+	}
+
+	/* insert the new entry into the free slot. */
+	dblock->entries[i].inode = inode->i_ino;
+	strncpy(dblock->entries[i].name, dentry->d_name.name, AUDI_FILENAME_LEN);
+	audi_dir_index_add(dir, i, inode->i_ino, dentry->d_name.name, dentry->d_name.len);
+	audi_dir_block_dirty(dir, bh);
+	brelse(bh);
+
+	dir->i_mtime = dir->i_ctime = current_fs_time(dir->i_sb);
+	mark_inode_dirty(dir);
+	return 0;
+}
+
 /*
  * this function is called to created a file or a directory under the directory,
  * which is represented by the first argument: dir. here we call this dir the parent directory.
@@ -253,17 +474,115 @@ put_ino:
  *   - if the new file's filename length is larger than AUDI_FILENAME_LEN, return -ENAMETOOLONG,
  *   - if the parent directory is already full, return -EMLINK - indicating "too many links",
  *   - otherwise, call audi_new_inode() to create an new inode, which will allocate a new inode and a new block,
- *   - insert the dentry representing the new file/directory into the end of the parent directory's dentry table.
+ *   - insert the dentry representing the new file/directory into the first free slot of the parent directory's dentry table,
+ *     if there is none, give the inode and the block back.
  */
 static int audi_create(struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {
 	struct inode *inode;
+	int ret;
+
     pr_info("creating a new file or directory...\n");
+	if (dentry->d_name.len > AUDI_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
     /* get a new free inode */
     inode = audi_new_inode(dir, mode);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	mark_inode_dirty(inode);
+
+	ret = audi_add_link(dir, dentry, inode);
+	if (ret) {
+		/* the parent is full: give the new inode and its block back, see audi_evict_inode(). */
+		clear_nlink(inode);
+		iput(inode);
+		return ret;
+	}
+	if (S_ISDIR(mode)) {
+		inc_nlink(dir); /* the new directory's ".." */
+		mark_inode_dirty(dir);
+	}
+
+	/* lookup() left a negative dentry for this name in the dcache, now it becomes positive. */
+	d_instantiate(dentry, inode);
     return 0;
 }
 
+/*
+ * create a hard link called dentry in dir, to the inode of old_dentry. the vfs makes sure
+ * old_dentry is not a directory. the new name shares the inode, and thus the data, with the old one.
+ */
+static int audi_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry)
+{
+	struct inode *inode = old_dentry->d_inode;
+	int ret;
+
+	pr_info("creating a hard link...\n");
+	if (dentry->d_name.len > AUDI_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	ret = audi_add_link(dir, dentry, inode);
+	if (ret)
+		return ret;
+
+	inode->i_ctime = current_fs_time(inode->i_sb);
+	inc_nlink(inode);
+	ihold(inode);
+	mark_inode_dirty(inode);
+	d_instantiate(dentry, inode);
+	return 0;
+}
+
+/*
+ * create a symlink called dentry in dir, pointing to symname. a target shorter than AUDI_FAST_SYMLINK_LEN
+ * (including the trailing NUL) is stored in the inode, a longer one goes into a data block, like ext2_symlink().
+ */
+static int audi_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	struct super_block *sb = dir->i_sb;
+	struct audi_inode_info *ai;
+	struct inode *inode;
+	unsigned int l = strlen(symname) + 1;
+	int ret;
+
+	pr_info("creating a symlink...\n");
+	if (dentry->d_name.len > AUDI_FILENAME_LEN)
+		return -ENAMETOOLONG;
+	if (l > sb->s_blocksize)
+		return -ENAMETOOLONG;
+
+	inode = audi_new_inode(dir, S_IFLNK | S_IRWXUGO);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+	ai = AUDI_INODE(inode);
+
+	if (l > AUDI_FAST_SYMLINK_LEN) {
+		/* slow symlink, audi_file_get_block() allocates its block as page_symlink() writes it. */
+		inode->i_op = &audi_symlink_inode_ops;
+		ret = page_symlink(inode, symname, l);
+		if (ret)
+			goto out_fail;
+	} else {
+		/* fast symlink */
+		inode->i_op = &audi_fast_symlink_inode_ops;
+		memcpy(ai->i_symlink, symname, l);
+		inode->i_size = l - 1;
+	}
+	mark_inode_dirty(inode);
+
+	ret = audi_add_link(dir, dentry, inode);
+	if (ret)
+		goto out_fail;
+	d_instantiate(dentry, inode);
+	return 0;
+
+out_fail:
+	clear_nlink(inode);
+	iput(inode);
+	return ret;
+}
+
 /* if we just run "ls", this lookup function won't be called - rather, audi_iterate() in dir.c will be called.
  * if we just run "ls -l", or "ls -la", or "ls -lai", this lookup function still won't be called - rather, audi_iterate() in dir.c will be called.
  * when we run a command like "ls -l a.txt" to list a file, this lookup function will be called; 
@@ -277,7 +596,53 @@ static int audi_create(struct inode *dir, struct dentry *dentry, umode_t mode, b
  * */
 static struct dentry *audi_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
+	struct super_block *sb = dir->i_sb;
+	struct audi_inode_info *ci = AUDI_INODE(dir);
+	struct inode *inode = NULL;
+	struct buffer_head *bh;
+	struct audi_dir_block *dblock;
+	struct audi_dir_entry *de;
+	uint32_t ino = 0;
+	int i;
+
 	pr_info("looking up...\n");
+	if (dentry->d_name.len > AUDI_FILENAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	/* a hot directory is resolved from its in-memory index, without touching the buffer. */
+	if (ci->dir_index) {
+		ino = audi_dir_index_find(dir, dentry->d_name.name, dentry->d_name.len);
+		goto found;
+	}
+
+	bh = sb_bread(sb, ci->i_block[0]);
+	if (!bh)
+		return ERR_PTR(-EIO);
+	dblock = (struct audi_dir_block *) bh->b_data;
+	/* "." and ".." never come here, the VFS handles them. */
+	for (i = 2; i < audi_dir_slots(dir); i++) {
+		de = &dblock->entries[i];
+		if (!de->inode)
+			continue;
+		if (audi_name_match(de, dentry->d_name.name, dentry->d_name.len)) {
+			ino = de->inode;
+			break;
+		}
+	}
+	/* next time, use the index. */
+	audi_dir_index_build(dir, dblock);
+	brelse(bh);
+
+found:
+	if (ino) {
+		inode = audi_iget(sb, ino);
+		if (IS_ERR(inode))
+			return ERR_CAST(inode);
+	}
+	/* cache the result either way: on a miss, inode is NULL and this is a negative dentry,
+	 * so the next lookup of this name is answered by the dcache without scanning the directory again.
+	 * create() turns it into a positive one, and the VFS turns positive ones back on unlink()/rmdir(). */
+	d_add(dentry, inode);
     return NULL;
 }
 
@@ -287,16 +652,62 @@ static struct dentry *audi_lookup(struct inode *dir, struct dentry *dentry, unsi
  * what this function should do:
  * - read parent's dentry table,
  * - search dentry in parent's dentry table, if not found, return -ENOENT.
- * - if found, delete it, and move dentries after this forward, then zero out the previous last dentry. 
+ * - if found, zero it out; the entries after it stay where they are, so readdir cookies stay valid.
  * - update parent's last modified time and last accessed time to current time.
  * - if removing a directory, decrement its parent's link count by 1.
  * - call mark_inode_dirty to flush parent's inode into disk.
- * - zero out child's data block, reset child's inode, update data block bitmap, and update inode bitmap.
+ * - decrement child's link count, and if it drops to 0: put the child on the orphan list;
+ *   audi_evict_inode() frees its blocks and its inode once the last user lets go of it.
  * - return 0.
  */
 static int audi_unlink(struct inode *dir, struct dentry *dentry)
 {
+	struct super_block *sb = dir->i_sb;
+	struct inode *inode = dentry->d_inode;
+	struct buffer_head *bh;
+	struct audi_dir_block *dblock;
+	int i;
+
 	pr_info("unlinking...\n");
+	bh = sb_bread(sb, AUDI_INODE(dir)->i_block[0]);
+	if (!bh)
+		return -EIO;
+	dblock = (struct audi_dir_block *) bh->b_data;
+	for (i = 2; i < audi_dir_slots(dir); i++) {
+		if (dblock->entries[i].inode == inode->i_ino &&
+			audi_name_match(&dblock->entries[i], dentry->d_name.name, dentry->d_name.len))
+			break;
+	}
+	if (i == audi_dir_slots(dir)) {
+		brelse(bh);
+		return -ENOENT;
+	}
+
+	/* zero out the slot, but do not move the entries after it: the slot index is the readdir cookie
+	 * (see audi_iterate()), so moving entries would make a getdents() in progress skip or repeat some. */
+	memset(&dblock->entries[i], 0, sizeof(struct audi_dir_entry));
+	audi_dir_index_del(dir, i);
+	audi_dir_block_dirty(dir, bh);
+	brelse(bh);
+
+	dir->i_mtime = dir->i_atime = dir->i_ctime = current_fs_time(dir->i_sb);
+	if (S_ISDIR(inode->i_mode))
+		drop_nlink(dir); /* the child's ".." is gone */
+	mark_inode_dirty(dir);
+
+	/* the child is only gone once its last name is gone, it may have hard links elsewhere;
+	 * and even then, its blocks are only freed once nobody has it open, see audi_evict_inode(). */
+	inode->i_ctime = dir->i_ctime;
+	if (S_ISDIR(inode->i_mode))
+		clear_nlink(inode);
+	else
+		drop_nlink(inode);
+	if (!inode->i_nlink) {
+		audi_orphan_add(inode);
+		audi_reclaim_queue(inode);
+	} else {
+		mark_inode_dirty(inode);
+	}
     return 0;
 }
 
@@ -309,16 +720,183 @@ static int audi_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 /* dir is the parent directory; dentry represents the directory we want to delete. */
 static int audi_rmdir(struct inode *dir, struct dentry *dentry)
 {
+	struct inode *inode = dentry->d_inode;
+	struct buffer_head *bh;
+	struct audi_dir_block *dblock;
+	int i, empty = 1;
+
 	pr_info("removing a directory...\n");
-    return 0;
+	/* a directory which only has . and .. is empty. */
+	bh = sb_bread(dir->i_sb, AUDI_INODE(inode)->i_block[0]);
+	if (!bh)
+		return -EIO;
+	dblock = (struct audi_dir_block *) bh->b_data;
+	for (i = 2; i < audi_dir_slots(inode); i++) {
+		if (dblock->entries[i].inode) {
+			empty = 0;
+			break;
+		}
+	}
+	brelse(bh);
+	if (!empty)
+		return -ENOTEMPTY;
+
+    return audi_unlink(dir, dentry);
+}
+
+/*
+ * move old_dentry in old_dir to new_dentry in new_dir. only the directory entries are rewritten,
+ * the file's data stays where it is. what this function does:
+ * - if new_dentry already exists (an empty directory, if it is a directory), its slot is reused,
+ *   otherwise the new name goes into the first free slot of new_dir,
+ * - the old slot is zeroed out, just like in unlink, so readdir cookies stay valid,
+ * - if a directory moves to another parent, its ".." is pointed at new_dir and both parents' link counts are fixed,
+ * - a replaced file loses its name, and its blocks are freed once it has no names left, and nobody has it open.
+ * the vfs has already locked both directories, checked that we do not move a directory into itself,
+ * that a directory only replaces a directory, and it returns early if both names refer to the same inode.
+ */
+static int audi_rename(struct inode *old_dir, struct dentry *old_dentry,
+			struct inode *new_dir, struct dentry *new_dentry)
+{
+	struct super_block *sb = old_dir->i_sb;
+	struct inode *inode = old_dentry->d_inode;
+	struct inode *target = new_dentry->d_inode;
+	struct buffer_head *old_bh, *new_bh, *bh, *child_bh = NULL;
+	struct audi_dir_block *old_dblock, *new_dblock, *dblock;
+	int old_slot, new_slot, i;
+	int ret = 0;
+
+	pr_info("renaming...\n");
+	if (new_dentry->d_name.len > AUDI_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	/* a directory can only be replaced when it is empty. */
+	if (target && S_ISDIR(target->i_mode)) {
+		bh = sb_bread(sb, AUDI_INODE(target)->i_block[0]);
+		if (!bh)
+			return -EIO;
+		dblock = (struct audi_dir_block *) bh->b_data;
+		for (i = 2; i < audi_dir_slots(target); i++) {
+			if (dblock->entries[i].inode) {
+				brelse(bh);
+				return -ENOTEMPTY;
+			}
+		}
+		brelse(bh);
+	}
+
+	old_bh = sb_bread(sb, AUDI_INODE(old_dir)->i_block[0]);
+	if (!old_bh)
+		return -EIO;
+	old_dblock = (struct audi_dir_block *) old_bh->b_data;
+	for (old_slot = 2; old_slot < audi_dir_slots(old_dir); old_slot++) {
+		if (old_dblock->entries[old_slot].inode == inode->i_ino &&
+			audi_name_match(&old_dblock->entries[old_slot], old_dentry->d_name.name, old_dentry->d_name.len))
+			break;
+	}
+	if (old_slot == audi_dir_slots(old_dir)) {
+		ret = -ENOENT;
+		goto out_old;
+	}
+
+	/* both names may live in the same block, then we just take another reference on it. */
+	if (new_dir == old_dir) {
+		get_bh(old_bh);
+		new_bh = old_bh;
+	} else {
+		new_bh = sb_bread(sb, AUDI_INODE(new_dir)->i_block[0]);
+		if (!new_bh) {
+			ret = -EIO;
+			goto out_old;
+		}
+	}
+	new_dblock = (struct audi_dir_block *) new_bh->b_data;
+	for (new_slot = 2; new_slot < audi_dir_slots(new_dir); new_slot++) {
+		if (target) {
+			if (new_dblock->entries[new_slot].inode == target->i_ino &&
+				audi_name_match(&new_dblock->entries[new_slot], new_dentry->d_name.name, new_dentry->d_name.len))
+				break;
+		} else if (!new_dblock->entries[new_slot].inode) {
+			break;
+		}
+	}
+	if (new_slot == audi_dir_slots(new_dir)) {
+		ret = target ? -ENOENT : -EMLINK;
+		goto out_new;
+	}
+
+	/* a directory which changes its parent needs its ".." fixed; read its block before we change anything,
+	 * so we do not end up with the entry moved and ".." still pointing at the old parent. */
+	if (S_ISDIR(inode->i_mode) && old_dir != new_dir) {
+		child_bh = sb_bread(sb, AUDI_INODE(inode)->i_block[0]);
+		if (!child_bh) {
+			ret = -EIO;
+			goto out_new;
+		}
+	}
+
+	/* write the new entry first, then drop the old one; strncpy also zeroes out the rest of the old name. */
+	if (target)
+		audi_dir_index_del(new_dir, new_slot);
+	new_dblock->entries[new_slot].inode = inode->i_ino;
+	strncpy(new_dblock->entries[new_slot].name, new_dentry->d_name.name, AUDI_FILENAME_LEN);
+	audi_dir_index_add(new_dir, new_slot, inode->i_ino, new_dentry->d_name.name, new_dentry->d_name.len);
+	memset(&old_dblock->entries[old_slot], 0, sizeof(struct audi_dir_entry));
+	audi_dir_index_del(old_dir, old_slot);
+	audi_dir_block_dirty(new_dir, new_bh);
+	audi_dir_block_dirty(old_dir, old_bh);
+
+	/* a directory which changes its parent: fix its ".." and the link counts of both parents. */
+	if (child_bh) {
+		dblock = (struct audi_dir_block *) child_bh->b_data;
+		dblock->entries[1].inode = new_dir->i_ino;
+		audi_dir_block_dirty(inode, child_bh);
+		drop_nlink(old_dir);
+		inc_nlink(new_dir);
+	}
+
+	if (target) {
+		target->i_ctime = current_fs_time(sb);
+		if (S_ISDIR(target->i_mode)) {
+			drop_nlink(new_dir); /* the replaced directory's ".." is gone */
+			clear_nlink(target);
+		} else {
+			drop_nlink(target);
+		}
+		if (!target->i_nlink) {
+			audi_orphan_add(target);
+			audi_reclaim_queue(target);
+		} else {
+			mark_inode_dirty(target);
+		}
+	}
+
+	old_dir->i_mtime = old_dir->i_ctime = current_fs_time(sb);
+	mark_inode_dirty(old_dir);
+	if (new_dir != old_dir) {
+		new_dir->i_mtime = new_dir->i_ctime = current_fs_time(sb);
+		mark_inode_dirty(new_dir);
+	}
+	inode->i_ctime = current_fs_time(sb);
+	mark_inode_dirty(inode);
+
+out_new:
+	brelse(child_bh);
+	brelse(new_bh);
+out_old:
+	brelse(old_bh);
+	return ret;
 }
 
 const struct inode_operations audi_dir_inode_ops = {
 	.lookup = audi_lookup, /* without this line, ls -a will not show the . and .. */
 	.create = audi_create,
+	.link = audi_link,
+	.symlink = audi_symlink,
 	.unlink = audi_unlink,
 	.mkdir = audi_mkdir,
 	.rmdir = audi_rmdir,
+	.rename = audi_rename,
 };
 
 /* vim: set ts=4: */
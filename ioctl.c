@@ -0,0 +1,420 @@
+/**
+ * ioctl.c - in this file we implement the ioctl handlers.
+ * this file is mainly mimicking fs/ext2/ioctl.c.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/blkdev.h> /* for sb_issue_discard() */
+#include <linux/file.h> /* for fget() */
+#include <linux/fs.h>
+#include <linux/highmem.h> /* for copy_highpage() */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mount.h> /* for mnt_want_write_file() */
+#include <linux/pagemap.h>
+#include <linux/uaccess.h>
+
+#include "bitmap.h"
+#include "audi.h"
+
+/*
+ * discard the blocks set in blocks (same bit order as the data bitmap: block 0 is the left most bit),
+ * in runs of at least minlen consecutive blocks. a block which got allocated again in the meantime
+ * is never discarded: we check the data bitmap right before we issue each run, and the run stays in s_trim_bitmap,
+ * where get_free_block() can not take it, until the discard is done.
+ * the number of bytes discarded is added to *trimmed.
+ */
+int audi_discard_free_blocks(struct super_block *sb, unsigned long long blocks, uint32_t minlen, uint64_t *trimmed)
+{
+	struct audi_fs_info *fsi = AUDI_FS(sb);
+	unsigned long long run;
+	uint32_t start, len;
+	int ret;
+
+	start = 0;
+	while (start < AUDI_MAX_BLOCKS) {
+		/* find the next run of consecutive blocks. */
+		run = 0;
+		len = 0;
+		while (start + len < AUDI_MAX_BLOCKS && (blocks & (1ULL << (63-(start+len))))) {
+			run |= (1ULL << (63-(start+len)));
+			len++;
+		}
+		if (!len) {
+			start++;
+			continue;
+		}
+		if (len < minlen) {
+			start += len;
+			continue;
+		}
+		/* skip it if it is in use again, or if someone else, FITRIM or a sync, is discarding it already. */
+		spin_lock(&fsi->s_bitmap_lock);
+		if ((fsi->s_data_bitmap | fsi->s_trim_bitmap) & run) {
+			spin_unlock(&fsi->s_bitmap_lock);
+			start += len;
+			continue;
+		}
+		fsi->s_trim_bitmap |= run;
+		spin_unlock(&fsi->s_bitmap_lock);
+
+		pr_info("discarding blocks %u to %u\n", start, start + len - 1);
+		ret = sb_issue_discard(sb, start, len, GFP_NOFS, 0);
+
+		spin_lock(&fsi->s_bitmap_lock);
+		fsi->s_trim_bitmap &= ~run;
+		spin_unlock(&fsi->s_bitmap_lock);
+		/* the device may stop supporting discard at any time, e.g., a loop device. */
+		if (ret)
+			return (ret == -EOPNOTSUPP) ? 0 : ret;
+		*trimmed += (uint64_t) len << sb->s_blocksize_bits;
+		start += len;
+	}
+	return 0;
+}
+
+/* FITRIM: discard every free run of at least range.minlen bytes within [range.start, range.start+range.len). */
+static int audi_trim_fs(struct super_block *sb, struct fstrim_range __user *urange)
+{
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range range;
+	unsigned long long blocks;
+	uint64_t first, last, trimmed = 0;
+	uint32_t minlen, bno;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (!blk_queue_discard(q))
+		return -EOPNOTSUPP;
+	if (copy_from_user(&range, urange, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+	minlen = DIV_ROUND_UP(range.minlen, sb->s_blocksize);
+	if (!minlen)
+		minlen = 1;
+	first = range.start >> sb->s_blocksize_bits;
+	if (range.len < sb->s_blocksize)
+		return -EINVAL;
+	last = (range.start + range.len - 1) >> sb->s_blocksize_bits;
+	if (last >= AUDI_MAX_BLOCKS)
+		last = AUDI_MAX_BLOCKS - 1;
+	if (first > last)
+		goto out;
+
+	/* the free blocks within the range. */
+	blocks = 0;
+	for (bno = first; bno <= last; bno++)
+		blocks |= (1ULL << (63-bno));
+	blocks &= ~AUDI_FS(sb)->s_data_bitmap;
+
+	ret = audi_discard_free_blocks(sb, blocks, minlen, &trimmed);
+	if (ret)
+		return ret;
+	/* whatever we just trimmed no longer needs a discard at sync time. */
+	spin_lock(&AUDI_FS(sb)->s_bitmap_lock);
+	AUDI_FS(sb)->s_discard_bitmap &= ~blocks;
+	spin_unlock(&AUDI_FS(sb)->s_bitmap_lock);
+out:
+	range.len = trimmed;
+	if (copy_to_user(urange, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * copy count pages of src, starting at page sindex, to dst, starting at page dindex; len is the number
+ * of bytes, only the last page may be partial. both inodes are locked.
+ * a page of src is copied straight into the page of dst, in the kernel, and dst's writeback puts it on the disk.
+ * we do not copy through the buffer cache of the device, because the page cache of both files may hold
+ * newer data than the blocks, and whatever we write there would not be seen by the page cache of dst.
+ * a page which is a hole in src becomes a hole in dst, we do not allocate blocks just to store zeroes;
+ * with blocks smaller than a page, a hole next to a block with data in the same page does get a block.
+ * *done is set to the number of pages of dst we got through, an error may leave the first ones copied.
+ */
+static int audi_copy_pages(struct inode *src, pgoff_t sindex, struct inode *dst, pgoff_t dindex, int count, u64 len,
+			int *done)
+{
+	struct audi_inode_info *sai = AUDI_INODE(src);
+	struct audi_inode_info *dai = AUDI_INODE(dst);
+	struct page *spage, *dpage;
+	unsigned long long holes = 0;
+	unsigned int per_page = 1 << (PAGE_CACHE_SHIFT - dst->i_blkbits);
+	unsigned int bytes, sblock, dblock, j;
+	void *fsdata;
+	loff_t pos;
+	int i, ret;
+
+	for (i = 0; i < count; i++, len -= bytes) {
+		pos = (loff_t) (dindex + i) << PAGE_CACHE_SHIFT;
+		bytes = min_t(u64, len, PAGE_CACHE_SIZE);
+		sblock = (sindex + i) * per_page;
+		dblock = (dindex + i) * per_page;
+		for (j = 0; j < per_page && sblock + j < AUDI_N_BLOCKS; j++)
+			if (sai->i_block[sblock + j])
+				break;
+		if (j == per_page || sblock + j >= AUDI_N_BLOCKS) {
+			truncate_inode_pages_range(dst->i_mapping, pos, pos + PAGE_CACHE_SIZE - 1);
+			for (j = 0; j < per_page && dblock + j < AUDI_N_BLOCKS; j++) {
+				if (!dai->i_block[dblock + j])
+					continue;
+				if (put_block_ref(AUDI_FS(dst->i_sb), dai->i_block[dblock + j]))
+					holes |= (1ULL << (63-dai->i_block[dblock + j]));
+				dai->i_block[dblock + j] = 0;
+			}
+			/* the hole may still be past the end of dst. */
+			if (pos + bytes > i_size_read(dst))
+				i_size_write(dst, pos + bytes);
+			continue;
+		}
+
+		spage = read_mapping_page(src->i_mapping, sindex + i, NULL);
+		if (IS_ERR(spage)) {
+			ret = PTR_ERR(spage);
+			goto out;
+		}
+		/* this allocates the blocks of dst if needed, and updates i_size. */
+		ret = pagecache_write_begin(NULL, dst->i_mapping, pos, bytes, AOP_FLAG_UNINTERRUPTIBLE, &dpage, &fsdata);
+		if (ret) {
+			page_cache_release(spage);
+			goto out;
+		}
+		copy_highpage(dpage, spage);
+		ret = pagecache_write_end(NULL, dst->i_mapping, pos, bytes, bytes, dpage, fsdata);
+		page_cache_release(spage);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	*done = i;
+	if (holes)
+		put_blocks(AUDI_FS(dst->i_sb), holes);
+	return ret;
+}
+
+/*
+ * the reflink version of audi_copy_pages(): dst's block map entries point at src's blocks, and every block
+ * gets one more reference in s_data_refcount. no data is read or written. a later write to either file gives
+ * the written block a copy of its own, see audi_unshare_page() in file.c.
+ */
+static int audi_clone_blocks(struct inode *src, u64 sblock, struct inode *dst, u64 dblock, int count, u64 len)
+{
+	struct audi_fs_info *fsi = AUDI_FS(dst->i_sb);
+	struct audi_inode_info *sai = AUDI_INODE(src);
+	struct audi_inode_info *dai = AUDI_INODE(dst);
+	unsigned long long freed = 0;
+	uint32_t bno;
+	loff_t pos;
+	int i, ret;
+
+	/* never index the block maps with anything the caller did not keep inside them. */
+	if (sblock + count > AUDI_N_BLOCKS || dblock + count > AUDI_N_BLOCKS)
+		return -EINVAL;
+	for (i = 0; i < count; i++) {
+		bno = sai->i_block[sblock + i];
+		/* the same block may show up more than once in the range. */
+		if (bno && fsi->s_data_refcount[bno] + count > AUDI_MAX_REFCOUNT)
+			return -EMLINK;
+	}
+
+	/* the blocks must hold what the page cache of src holds, and dst must forget its old pages. */
+	pos = (loff_t) sblock << src->i_blkbits;
+	ret = filemap_write_and_wait_range(src->i_mapping, pos, pos + len - 1);
+	if (ret)
+		return ret;
+	pos = (loff_t) dblock << dst->i_blkbits;
+	truncate_inode_pages_range(dst->i_mapping, pos, pos + round_up((loff_t) count << dst->i_blkbits, PAGE_CACHE_SIZE) - 1);
+
+	for (i = 0; i < count; i++) {
+		bno = sai->i_block[sblock + i];
+		if (bno) {
+			spin_lock(&fsi->s_bitmap_lock);
+			fsi->s_data_refcount[bno]++;
+			spin_unlock(&fsi->s_bitmap_lock);
+		}
+		if (dai->i_block[dblock + i] && put_block_ref(fsi, dai->i_block[dblock + i]))
+			freed |= (1ULL << (63-dai->i_block[dblock + i]));
+		dai->i_block[dblock + i] = bno;
+	}
+	if (freed)
+		put_blocks(fsi, freed);
+	if (pos + len > i_size_read(dst))
+		i_size_write(dst, pos + len);
+	return 0;
+}
+
+/*
+ * AUDI_IOC_COPY_RANGE and AUDI_IOC_CLONE_RANGE, see struct audi_copy_range in audi.h.
+ * the checks mimic btrfs_ioctl_clone().
+ * this is what cp and friends would otherwise do with read() and write(), minus the trips through userspace,
+ * and with clone, minus the data itself.
+ */
+static long audi_copy_range(struct file *dst_file, struct audi_copy_range __user *uarg, int clone)
+{
+	struct inode *dst = file_inode(dst_file);
+	struct inode *src;
+	struct file *src_file;
+	struct audi_copy_range args;
+	u64 len, isize;
+	int done = 0;
+	long ret;
+
+	if (copy_from_user(&args, uarg, sizeof(args)))
+		return -EFAULT;
+	if (!(dst_file->f_mode & FMODE_WRITE) || (dst_file->f_flags & O_APPEND))
+		return -EINVAL;
+
+	src_file = fget(args.src_fd);
+	if (!src_file)
+		return -EBADF;
+	src = file_inode(src_file);
+
+	ret = -EBADF;
+	if (!(src_file->f_mode & FMODE_READ))
+		goto out_fput;
+	ret = -EXDEV;
+	if (src->i_sb != dst->i_sb)
+		goto out_fput;
+	ret = -EINVAL;
+	if (!S_ISREG(src->i_mode) || !S_ISREG(dst->i_mode))
+		goto out_fput;
+	/* the block maps of compressed files do not map blocks one to one. */
+	ret = -EOPNOTSUPP;
+	if (audi_compressed(src) || audi_compressed(dst))
+		goto out_fput;
+	/* the page cache works a page at a time, and a block is never bigger than a page, see audi_fill_super(). */
+	ret = -EINVAL;
+	if (!IS_ALIGNED(args.src_offset, PAGE_CACHE_SIZE) || !IS_ALIGNED(args.dest_offset, PAGE_CACHE_SIZE))
+		goto out_fput;
+
+	ret = mnt_want_write_file(dst_file);
+	if (ret)
+		goto out_fput;
+
+	/* always lock the inodes in the same order, so two copies going opposite ways do not deadlock. */
+	if (src == dst) {
+		mutex_lock(&src->i_mutex);
+	} else if (src < dst) {
+		mutex_lock_nested(&src->i_mutex, I_MUTEX_PARENT);
+		mutex_lock_nested(&dst->i_mutex, I_MUTEX_CHILD);
+	} else {
+		mutex_lock_nested(&dst->i_mutex, I_MUTEX_PARENT);
+		mutex_lock_nested(&src->i_mutex, I_MUTEX_CHILD);
+	}
+
+	ret = -EINVAL;
+	isize = i_size_read(src);
+	if (args.src_offset >= isize)
+		goto out_unlock;
+	len = args.src_length;
+	/* none of the sums below may wrap around 2^64, like btrfs_ioctl_clone() checks. */
+	if (args.src_offset + len < args.src_offset)
+		goto out_unlock;
+	if (!len || args.src_offset + len > isize)
+		len = isize - args.src_offset;
+	if (args.dest_offset + len < args.dest_offset)
+		goto out_unlock;
+	/* a partial last page is only fine when it becomes the end of dst, otherwise we would copy the rest of
+	 * that page over data of dst. */
+	if (!IS_ALIGNED(len, PAGE_CACHE_SIZE) &&
+		(args.src_offset + len != isize || args.dest_offset + len < i_size_read(dst)))
+		goto out_unlock;
+	if (src == dst && args.dest_offset + len > args.src_offset && args.src_offset + len > args.dest_offset)
+		goto out_unlock;
+	ret = -EFBIG;
+	if (args.dest_offset + len > dst->i_sb->s_maxbytes)
+		goto out_unlock;
+
+	if (clone)
+		ret = audi_clone_blocks(src, args.src_offset >> src->i_blkbits, dst, args.dest_offset >> dst->i_blkbits,
+				DIV_ROUND_UP(len, dst->i_sb->s_blocksize), len);
+	else
+		ret = audi_copy_pages(src, args.src_offset >> PAGE_CACHE_SHIFT, dst, args.dest_offset >> PAGE_CACHE_SHIFT,
+				DIV_ROUND_UP(len, PAGE_CACHE_SIZE), len, &done);
+	/* a clone which fails leaves dst alone, a copy may have got through some pages first. */
+	if (ret >= 0 || done) {
+		dst->i_mtime = dst->i_ctime = current_fs_time(dst->i_sb);
+		mark_inode_dirty(dst);
+	}
+
+out_unlock:
+	mutex_unlock(&src->i_mutex);
+	if (src != dst)
+		mutex_unlock(&dst->i_mutex);
+	mnt_drop_write_file(dst_file);
+out_fput:
+	fput(src_file);
+	return ret;
+}
+
+/*
+ * chattr: AUDI_COMPR_FL is the only flag we have. it can only change while the file is empty,
+ * so a file never has clusters written both ways, see compress.c.
+ */
+static long audi_setflags(struct file *filp, int __user *uarg)
+{
+	struct inode *inode = file_inode(filp);
+	struct audi_inode_info *ai = AUDI_INODE(inode);
+	int flags;
+	long ret;
+
+	if (!inode_owner_or_capable(inode))
+		return -EACCES;
+	if (get_user(flags, uarg))
+		return -EFAULT;
+	if (flags & ~AUDI_COMPR_FL)
+		return -EOPNOTSUPP;
+	/* compress.c takes a block for a page, no other block size can have compressed files. */
+	if ((flags & AUDI_COMPR_FL) && inode->i_sb->s_blocksize != PAGE_CACHE_SIZE)
+		return -EOPNOTSUPP;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+	mutex_lock(&inode->i_mutex);
+	if ((flags ^ ai->i_flags) & AUDI_COMPR_FL) {
+		ret = -EOPNOTSUPP;
+		if (!S_ISREG(inode->i_mode) || ((flags & AUDI_COMPR_FL) && !audi_compr_algo()))
+			goto out;
+		ret = -EBUSY;
+		if (i_size_read(inode) || inode->i_mapping->nrpages)
+			goto out;
+		ai->i_flags = flags;
+		inode->i_mapping->a_ops = (flags & AUDI_COMPR_FL) ? &audi_compr_aops : &audi_aops;
+		inode->i_ctime = current_fs_time(inode->i_sb);
+		mark_inode_dirty(inode);
+	}
+	ret = 0;
+out:
+	mutex_unlock(&inode->i_mutex);
+	mnt_drop_write_file(filp);
+	return ret;
+}
+
+long audi_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		return put_user(AUDI_INODE(file_inode(filp))->i_flags, (int __user *) arg);
+	case FS_IOC_SETFLAGS:
+		return audi_setflags(filp, (int __user *) arg);
+	case FITRIM:
+		return audi_trim_fs(sb, (struct fstrim_range __user *) arg);
+	case AUDI_IOC_COPY_RANGE:
+		return audi_copy_range(filp, (struct audi_copy_range __user *) arg, 0);
+	case AUDI_IOC_CLONE_RANGE:
+		return audi_copy_range(filp, (struct audi_copy_range __user *) arg, 1);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* vim: set ts=4: */
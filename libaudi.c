@@ -0,0 +1,484 @@
+/**
+ * libaudi.c - userspace library to access an audi image, see libaudi.h.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include "libaudi.h"
+
+int audi_image_open(struct audi_image *img, const char *path, int writable)
+{
+    struct stat st;
+    int ret;
+
+    memset(img, 0, sizeof(*img));
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0)
+        return -errno;
+
+    if (fstat(img->fd, &st)) {
+        ret = -errno;
+        goto err_close;
+    }
+    img->size = st.st_size;
+    /* just like mkfs.c, ask the block device for its size */
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t blk_size = 0;
+        if (ioctl(img->fd, BLKGETSIZE64, &blk_size)) {
+            ret = -errno;
+            goto err_close;
+        }
+        img->size = blk_size;
+    }
+    /* we do not know the block size before we read the superblock, but it is at least this much. */
+    if (img->size < (size_t) AUDI_MIN_BLOCK_SIZE * (AUDI_INODE_TABLE_BLOCK_NR + AUDI_INODE_BLOCKS + 1)) {
+        ret = -EINVAL;
+        goto err_close;
+    }
+
+    /* a read-only image is mapped private, so nothing we do can ever reach the disk. */
+    img->base = mmap(NULL, img->size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     writable ? MAP_SHARED : MAP_PRIVATE, img->fd, 0);
+    if (img->base == MAP_FAILED) {
+        ret = -errno;
+        goto err_close;
+    }
+    img->writable = writable;
+    img->sb = (struct audi_sb_info *) img->base;
+    if (le32toh(img->sb->s_magic) != AUDI_MAGIC) {
+        ret = -EINVAL;
+        goto err_unmap;
+    }
+
+    /* unlike the kernel module, we do not care about the page size, any block size mkfs accepts is fine. */
+    img->block_size = audi_block_size(img->sb);
+    img->nr_blocks = img->size / img->block_size;
+    if (img->block_size < AUDI_MIN_BLOCK_SIZE || img->block_size > AUDI_MAX_BLOCK_SIZE ||
+        (img->block_size & (img->block_size - 1)) || img->nr_blocks <= AUDI_INODE_TABLE_BLOCK_NR + AUDI_INODE_BLOCKS) {
+        ret = -EINVAL;
+        goto err_unmap;
+    }
+    img->inode_bitmap = (uint64_t *) (img->base + AUDI_INODE_BITMAP_BLOCK_NR * img->block_size);
+    img->data_bitmap = (uint64_t *) (img->base + AUDI_DATA_BITMAP_BLOCK_NR * img->block_size);
+    img->data_refcount = (uint8_t *) (img->base + AUDI_DATA_BITMAP_BLOCK_NR * img->block_size + AUDI_REFCOUNT_OFFSET);
+    return 0;
+
+err_unmap:
+    munmap(img->base, img->size);
+err_close:
+    close(img->fd);
+    img->fd = -1;
+    return ret;
+}
+
+/* again, we count from the left most bit, see bitmap.h */
+static inline uint64_t audi_bit(uint32_t nr)
+{
+    return 1ULL << (63 - nr);
+}
+
+void audi_image_dirty_inode(struct audi_image *img, uint32_t ino)
+{
+    if (ino < 64)
+        img->dirty_inodes |= audi_bit(ino);
+}
+
+void audi_image_dirty_super(struct audi_image *img)
+{
+    img->dirty_super = 1;
+}
+
+void audi_image_update_checksums(struct audi_image *img)
+{
+    struct audi_inode *inode;
+    struct audi_dir_block *dblock;
+    uint32_t ino, n = audi_image_itable_initialized(img);
+    size_t k;
+
+    if (!audi_has_csum(img->sb))
+        goto out;
+    /* an inode which was never written stays all zeroes, see audi_iget(). */
+    for (ino = 0; ino < n && ino < 64; ino++) {
+        if (!(img->dirty_inodes & audi_bit(ino)))
+            continue;
+        inode = audi_image_inode(img, ino);
+        for (k = 0; k < sizeof(*inode) && !((char *) inode)[k]; k++)
+            ;
+        if (k == sizeof(*inode))
+            continue;
+        dblock = audi_image_dir_block(img, ino);
+        if (dblock)
+            inode->i_dir_checksum = htole32(audi_crc32c(AUDI_CRC32C_SEED, dblock, img->block_size));
+        inode->i_checksum = htole32(audi_inode_checksum(ino, inode));
+    }
+    if (img->dirty_super) {
+        img->sb->s_inode_bitmap_csum = htole32(audi_crc32c(AUDI_CRC32C_SEED, img->inode_bitmap, AUDI_INODE_BITMAP_CSUM_LEN));
+        img->sb->s_data_bitmap_csum = htole32(audi_crc32c(AUDI_CRC32C_SEED, img->data_bitmap, AUDI_DATA_BITMAP_CSUM_LEN));
+        img->sb->s_checksum = htole32(audi_sb_checksum(img->sb));
+    }
+out:
+    img->dirty_inodes = 0;
+    img->dirty_super = 0;
+}
+
+int audi_image_sync(struct audi_image *img)
+{
+    if (!img->writable)
+        return 0;
+    audi_image_update_checksums(img);
+    if (msync(img->base, img->size, MS_SYNC))
+        return -errno;
+    return 0;
+}
+
+void audi_image_close(struct audi_image *img)
+{
+    if (img->fd < 0)
+        return;
+    audi_image_sync(img);
+    munmap(img->base, img->size);
+    close(img->fd);
+    img->fd = -1;
+}
+
+void *audi_image_block(struct audi_image *img, uint32_t bno)
+{
+    if (bno >= img->nr_blocks)
+        return NULL;
+    return img->base + (size_t) bno * img->block_size;
+}
+
+struct audi_inode *audi_image_inode(struct audi_image *img, uint32_t ino)
+{
+    struct audi_inode *table;
+
+    if (ino >= le32toh(img->sb->s_inodes_count))
+        return NULL;
+    /* the inode table is contiguous, so we do not need to split ino into a block and an offset. */
+    table = audi_image_block(img, AUDI_INODE_TABLE_BLOCK_NR);
+    return table + ino;
+}
+
+struct audi_dir_block *audi_image_dir_block(struct audi_image *img, uint32_t ino)
+{
+    struct audi_inode *inode = audi_image_inode(img, ino);
+
+    if (!inode || !S_ISDIR(le32toh(inode->i_mode)))
+        return NULL;
+    return audi_image_block(img, le32toh(inode->i_block[0]));
+}
+
+int audi_image_inode_used(struct audi_image *img, uint32_t ino)
+{
+    return ino < 64 && (le64toh(*img->inode_bitmap) & audi_bit(ino)) != 0;
+}
+
+int audi_image_block_used(struct audi_image *img, uint32_t bno)
+{
+    return bno < 64 && (le64toh(*img->data_bitmap) & audi_bit(bno)) != 0;
+}
+
+void audi_image_mark_inode(struct audi_image *img, uint32_t ino, int used)
+{
+    uint64_t map = le64toh(*img->inode_bitmap);
+
+    if (ino >= 64)
+        return;
+    map = used ? (map | audi_bit(ino)) : (map & ~audi_bit(ino));
+    *img->inode_bitmap = htole64(map);
+    img->dirty_super = 1;
+}
+
+void audi_image_mark_block(struct audi_image *img, uint32_t bno, int used)
+{
+    uint64_t map = le64toh(*img->data_bitmap);
+
+    if (bno >= 64)
+        return;
+    map = used ? (map | audi_bit(bno)) : (map & ~audi_bit(bno));
+    *img->data_bitmap = htole64(map);
+    img->dirty_super = 1;
+}
+
+uint32_t audi_image_itable_initialized(struct audi_image *img)
+{
+    return le32toh(img->sb->s_inodes_count) - le32toh(img->sb->s_itable_unused);
+}
+
+/* same as audi_init_itable() in the kernel module. */
+static void audi_image_init_itable(struct audi_image *img, uint32_t ino)
+{
+    uint32_t count = le32toh(img->sb->s_inodes_count);
+    uint32_t initialized = audi_image_itable_initialized(img);
+
+    while (ino >= initialized) {
+        memset(audi_image_block(img, AUDI_INODE_TABLE_BLOCK_NR + initialized / AUDI_INODES_PER_BLOCK(img->block_size)), 0, img->block_size);
+        initialized = (initialized / AUDI_INODES_PER_BLOCK(img->block_size) + 1) * AUDI_INODES_PER_BLOCK(img->block_size);
+        if (initialized > count)
+            initialized = count;
+        img->sb->s_itable_unused = htole32(count - initialized);
+    }
+}
+
+uint32_t audi_image_alloc_inode(struct audi_image *img)
+{
+    uint32_t ino, max = le32toh(img->sb->s_inodes_count);
+
+    /* inode 0 is invalid, mkfs marks it used anyway; this matches get_free_inode() in bitmap.h. */
+    for (ino = 1; ino < 64 && ino < max; ino++) {
+        if (!audi_image_inode_used(img, ino)) {
+            audi_image_init_itable(img, ino);
+            audi_image_mark_inode(img, ino, 1);
+            img->sb->s_free_inodes_count = htole32(le32toh(img->sb->s_free_inodes_count) - 1);
+            return ino;
+        }
+    }
+    return 0;
+}
+
+uint32_t audi_image_alloc_block(struct audi_image *img)
+{
+    uint32_t bno;
+
+    for (bno = AUDI_INODE_TABLE_BLOCK_NR + AUDI_INODE_BLOCKS; bno < 64 && bno < img->nr_blocks; bno++) {
+        if (!audi_image_block_used(img, bno)) {
+            audi_image_mark_block(img, bno, 1);
+            img->sb->s_free_blocks_count = htole32(le32toh(img->sb->s_free_blocks_count) - 1);
+            return bno;
+        }
+    }
+    return 0;
+}
+
+/* empty slots have inode 0, audi_unlink() leaves them behind, so we skip them rather than stop at them. */
+int audi_image_iterate(struct audi_image *img, uint32_t dir, audi_iterate_fn fn, void *arg)
+{
+    struct audi_dir_block *dblock = audi_image_dir_block(img, dir);
+    int i, ret;
+
+    if (!dblock)
+        return -ENOTDIR;
+    for (i = 0; i < AUDI_DIR_SLOTS(img->block_size); i++) {
+        if (!dblock->entries[i].inode)
+            continue;
+        ret = fn(arg, &dblock->entries[i], i);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+uint32_t audi_image_lookup(struct audi_image *img, uint32_t dir, const char *name)
+{
+    struct audi_dir_block *dblock = audi_image_dir_block(img, dir);
+    int i, len = strlen(name);
+
+    if (!dblock)
+        return 0;
+    for (i = 0; i < AUDI_DIR_SLOTS(img->block_size); i++) {
+        if (dblock->entries[i].inode && audi_name_match(&dblock->entries[i], name, len))
+            return le32toh(dblock->entries[i].inode);
+    }
+    return 0;
+}
+
+/* set the change and modification times of inode, and its access time too if atime, to now.
+ * a version 1 inode only keeps the seconds, see AUDI_FEATURE_INODE_V2. */
+static void audi_image_stamp(struct audi_image *img, struct audi_inode *inode, int atime)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    inode->i_ctime = inode->i_mtime = htole32(now.tv_sec);
+    if (atime)
+        inode->i_atime = htole32(now.tv_sec);
+    if (!audi_has_inode_v2(img->sb))
+        return;
+    inode->i_ctime_nsec = inode->i_mtime_nsec = htole32(now.tv_nsec);
+    if (atime)
+        inode->i_atime_nsec = htole32(now.tv_nsec);
+}
+
+/* the same thing audi_new_inode() and audi_create() do in the kernel module. */
+int audi_image_create(struct audi_image *img, uint32_t dir, const char *name, uint32_t mode)
+{
+    struct audi_dir_block *dblock = audi_image_dir_block(img, dir);
+    struct audi_dir_block *new_dblock;
+    struct audi_inode *dinode, *inode;
+    uint32_t ino, bno;
+    int slot;
+
+    if (!img->writable)
+        return -EROFS;
+    if (!dblock)
+        return -ENOTDIR;
+    if (!S_ISDIR(mode) && !S_ISREG(mode))
+        return -EINVAL;
+    /* a name of exactly AUDI_FILENAME_LEN bytes is stored without the trailing NUL, like audi_create() does. */
+    if (strlen(name) > AUDI_FILENAME_LEN)
+        return -ENAMETOOLONG;
+    if (audi_image_lookup(img, dir, name))
+        return -EEXIST;
+
+    for (slot = 2; slot < AUDI_DIR_SLOTS(img->block_size); slot++)
+        if (!dblock->entries[slot].inode)
+            break;
+    if (slot == AUDI_DIR_SLOTS(img->block_size))
+        return -EMLINK;
+
+    ino = audi_image_alloc_inode(img);
+    if (!ino)
+        return -ENOSPC;
+    /* only a directory gets its block right away, a regular file gets them as it is written. */
+    bno = 0;
+    if (S_ISDIR(mode)) {
+        bno = audi_image_alloc_block(img);
+        if (!bno) {
+            audi_image_mark_inode(img, ino, 0);
+            img->sb->s_free_inodes_count = htole32(le32toh(img->sb->s_free_inodes_count) + 1);
+            return -ENOSPC;
+        }
+        memset(audi_image_block(img, bno), 0, img->block_size);
+    }
+
+    dinode = audi_image_inode(img, dir);
+    inode = audi_image_inode(img, ino);
+    memset(inode, 0, sizeof(*inode));
+    inode->i_mode = htole32(mode);
+    inode->i_uid = dinode->i_uid;
+    inode->i_gid = dinode->i_gid;
+    audi_image_stamp(img, inode, 1);
+    inode->i_block[0] = htole32(bno);
+    if (S_ISDIR(mode)) {
+        new_dblock = audi_image_block(img, bno);
+        new_dblock->entries[0].inode = htole32(ino);
+        strcpy(new_dblock->entries[0].name, ".");
+        new_dblock->entries[1].inode = htole32(dir);
+        strcpy(new_dblock->entries[1].name, "..");
+        audi_inode_set_size(img->sb, inode, img->block_size);
+        inode->i_nlink = htole32(2);
+        dinode->i_nlink = htole32(le32toh(dinode->i_nlink) + 1);
+    } else {
+        inode->i_nlink = htole32(1);
+    }
+
+    strncpy(dblock->entries[slot].name, name, AUDI_FILENAME_LEN);
+    dblock->entries[slot].inode = htole32(ino);
+    audi_image_stamp(img, dinode, 0);
+    audi_image_dirty_inode(img, dir);
+    audi_image_dirty_inode(img, ino);
+    return ino;
+}
+
+ssize_t audi_image_read(struct audi_image *img, uint32_t ino, void *buf, size_t len, off_t off)
+{
+    struct audi_inode *inode = audi_image_inode(img, ino);
+    uint64_t size;
+    uint32_t bno;
+    size_t done, chunk, boff;
+    char *block;
+
+    if (!inode)
+        return -EINVAL;
+    if (S_ISDIR(le32toh(inode->i_mode)))
+        return -EISDIR;
+    /* compressed clusters need lz4 or lzo, see compress.c; we do not link against either. */
+    if (le32toh(inode->i_flags) & AUDI_COMPR_FL)
+        return -EOPNOTSUPP;
+    /* the size comes from the image, do not let a corrupt one take us past the block map. */
+    size = audi_inode_size(img->sb, inode);
+    if (size > AUDI_MAX_FILESIZE(img->block_size))
+        size = AUDI_MAX_FILESIZE(img->block_size);
+    if (off < 0)
+        return -EINVAL;
+    if ((uint64_t) off >= size)
+        return 0;
+    if (len > size - off)
+        len = size - off;
+    for (done = 0; done < len; done += chunk) {
+        boff = (off + done) % img->block_size;
+        chunk = img->block_size - boff;
+        if (chunk > len - done)
+            chunk = len - done;
+        bno = le32toh(inode->i_block[(off + done) / img->block_size]);
+        /* a block which was never written reads as zeroes, like audi_file_get_block() leaves it unmapped. */
+        if (!bno) {
+            memset((char *) buf + done, 0, chunk);
+            continue;
+        }
+        block = audi_image_block(img, bno);
+        if (!block)
+            return -EIO;
+        memcpy((char *) buf + done, block + boff, chunk);
+    }
+    return len;
+}
+
+ssize_t audi_image_write(struct audi_image *img, uint32_t ino, const void *buf, size_t len, off_t off)
+{
+    struct audi_inode *inode = audi_image_inode(img, ino);
+    uint32_t bno, new_bno, i;
+    size_t done, chunk, boff;
+    char *block;
+
+    if (!img->writable)
+        return -EROFS;
+    if (!inode)
+        return -EINVAL;
+    if (S_ISDIR(le32toh(inode->i_mode)))
+        return -EISDIR;
+    /* compressed clusters need lz4 or lzo, see compress.c; we do not link against either. */
+    if (le32toh(inode->i_flags) & AUDI_COMPR_FL)
+        return -EOPNOTSUPP;
+    /* same limit as audi_write_begin() */
+    if (off < 0 || (uint64_t) off + len > AUDI_MAX_FILESIZE(img->block_size))
+        return -ENOSPC;
+    for (done = 0; done < len; done += chunk) {
+        i = (off + done) / img->block_size;
+        boff = (off + done) % img->block_size;
+        chunk = img->block_size - boff;
+        if (chunk > len - done)
+            chunk = len - done;
+        bno = le32toh(inode->i_block[i]);
+        if (!bno || (bno < AUDI_MAX_BLOCKS && img->data_refcount[bno])) {
+            /* allocate on write, the same thing audi_file_get_block() does;
+             * and a block shared with another file gets copied first, like audi_unshare_page(). */
+            new_bno = audi_image_alloc_block(img);
+            if (!new_bno)
+                return done ? (ssize_t) done : -ENOSPC;
+            if (bno) {
+                memcpy(audi_image_block(img, new_bno), audi_image_block(img, bno), img->block_size);
+                img->data_refcount[bno]--;
+            } else {
+                memset(audi_image_block(img, new_bno), 0, img->block_size);
+            }
+            bno = new_bno;
+            inode->i_block[i] = htole32(bno);
+            /* a short write still changed the block map. */
+            audi_image_dirty_inode(img, ino);
+        }
+        block = audi_image_block(img, bno);
+        if (!block)
+            return -EIO;
+        memcpy(block + boff, (const char *) buf + done, chunk);
+        if (off + done + chunk > audi_inode_size(img->sb, inode))
+            audi_inode_set_size(img->sb, inode, off + done + chunk);
+    }
+    audi_image_stamp(img, inode, 0);
+    audi_image_dirty_inode(img, ino);
+    return len;
+}
+
+/* vim: set ts=4: */
@@ -0,0 +1,94 @@
+/**
+ * libaudi.h - userspace library to access an audi image without the kernel module.
+ *
+ * the image is mmap'ed as a whole, so the superblock, the bitmaps, the inode table
+ * and the directory blocks are handed out as pointers into the mapping: no copies,
+ * and every change made through these pointers goes straight into the image.
+ * the on-disk structures are the very same ones defined in audi.h.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#ifndef LIBAUDI_H
+#define LIBAUDI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "audi.h"
+
+/* block layout, same as the kernel module: see the picture in audi.h. */
+#define AUDI_SUPER_BLOCK_NR 0
+#define AUDI_INODE_BITMAP_BLOCK_NR 1
+#define AUDI_DATA_BITMAP_BLOCK_NR 2
+#define AUDI_INODE_TABLE_BLOCK_NR 3
+
+struct audi_image {
+    int fd;
+    int writable;
+    size_t size;          /* size of the mapping in bytes */
+    uint32_t block_size;  /* in bytes, from the superblock, see audi_block_size() */
+    uint32_t nr_blocks;   /* number of blocks in the mapping */
+    char *base;           /* the mapping itself, block 0 starts here */
+    struct audi_sb_info *sb;
+    uint64_t *inode_bitmap;  /* points into block 1 */
+    uint64_t *data_bitmap;   /* points into block 2 */
+    uint8_t *data_refcount;  /* points into block 2 too, right after the bitmap, see AUDI_REFCOUNT_OFFSET in audi.h */
+    /* what changed since the last sync, see audi_image_dirty_inode() */
+    uint64_t dirty_inodes;   /* same bit order as the inode bitmap */
+    int dirty_super;         /* the superblock, or one of the bitmaps whose checksums it holds */
+};
+
+/* called once for each used entry of a directory, the slot is the index of the entry in the directory block.
+ * return non-zero to stop the iteration, this value is then returned by audi_image_iterate(). */
+typedef int (*audi_iterate_fn)(void *arg, struct audi_dir_entry *de, int slot);
+
+/* open/close. writable is 0 for a read-only (MAP_PRIVATE, PROT_READ) mapping.
+ * return 0 on success, -errno on failure. */
+int audi_image_open(struct audi_image *img, const char *path, int writable);
+/* audi_image_sync() first recomputes the checksums (see AUDI_FEATURE_CSUM in audi.h) of what changed, and of
+ * nothing else: a corrupt object nobody touched keeps its bad checksum, so fsck.audi still finds it.
+ * the functions below mark what they change themselves; callers which change the image through the pointers
+ * must tell with audi_image_dirty_inode() (an inode, or the block of a directory) and audi_image_dirty_super()
+ * (the superblock, or the bitmaps). */
+int audi_image_sync(struct audi_image *img);
+void audi_image_update_checksums(struct audi_image *img);
+void audi_image_dirty_inode(struct audi_image *img, uint32_t ino);
+void audi_image_dirty_super(struct audi_image *img);
+void audi_image_close(struct audi_image *img);
+
+/* zero-copy accessors, they return NULL if the number is out of range. */
+void *audi_image_block(struct audi_image *img, uint32_t bno);
+struct audi_inode *audi_image_inode(struct audi_image *img, uint32_t ino);
+struct audi_dir_block *audi_image_dir_block(struct audi_image *img, uint32_t ino);
+
+/* bitmaps, bit 0 is the left most bit of the 64-bit bitmap, just like in bitmap.h. */
+int audi_image_inode_used(struct audi_image *img, uint32_t ino);
+int audi_image_block_used(struct audi_image *img, uint32_t bno);
+void audi_image_mark_inode(struct audi_image *img, uint32_t ino, int used);
+void audi_image_mark_block(struct audi_image *img, uint32_t bno, int used);
+/* number of inodes at the start of the inode table which are initialized, see s_itable_unused in audi.h.
+ * the rest of the table may contain garbage. */
+uint32_t audi_image_itable_initialized(struct audi_image *img);
+/* allocate the lowest free inode/block, and update the free counts in the superblock.
+ * return 0 if nothing is free. */
+uint32_t audi_image_alloc_inode(struct audi_image *img);
+uint32_t audi_image_alloc_block(struct audi_image *img);
+
+/* directory operations.
+ * audi_image_lookup() returns the inode number of name in directory dir, or 0 if it is not there. */
+uint32_t audi_image_lookup(struct audi_image *img, uint32_t dir, const char *name);
+int audi_image_iterate(struct audi_image *img, uint32_t dir, audi_iterate_fn fn, void *arg);
+/* create a regular file or a directory (depending on mode) called name in directory dir.
+ * return the new inode number, or -errno. */
+int audi_image_create(struct audi_image *img, uint32_t dir, const char *name, uint32_t mode);
+
+/* file data. return the number of bytes read/written, or -errno; -EOPNOTSUPP for a compressed file. */
+ssize_t audi_image_read(struct audi_image *img, uint32_t ino, void *buf, size_t len, off_t off);
+ssize_t audi_image_write(struct audi_image *img, uint32_t ino, const void *buf, size_t len, off_t off);
+
+#endif /* LIBAUDI_H */
+
+/* vim: set ts=4: */
@@ -4,7 +4,9 @@
  *   Jidong Xiao <jidongxiao@boisestate.edu>
  */
 
+#define _GNU_SOURCE /* for fallocate() */
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,14 +15,63 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include "audi.h"
 
+/* the inode bitmap is a single 64-bit word, see bitmap.h. */
+#define AUDI_BITMAP_BITS 64
+
+/* chosen with -b, see audi_block_size() in audi.h. */
+static uint32_t block_size = AUDI_DEFAULT_BLOCK_SIZE;
+
+/* -C turns AUDI_FEATURE_CSUM off, to measure what the checksums cost; we still fill them in, nobody reads them. */
+static uint32_t features = AUDI_FEATURE_CSUM | AUDI_FEATURE_INODE_V2;
+
 struct superblock {
-    struct audi_sb_info info; /* 20 bytes */
-    char padding[4076]; /* Padding to match block size: 20+4076 = 4096 bytes = 4KB  */
+    struct audi_sb_info info; /* 48 bytes */
+    char padding[AUDI_MAX_BLOCK_SIZE - sizeof(struct audi_sb_info)]; /* Padding to match the largest block size, we only write block_size bytes of it */
 };
 
+/* the first blocks of the bitmaps, and the root directory's block. they are filled in here, because the superblock
+ * and the root inode need their checksums before they are written. */
+static void fill_inode_bitmap(char *block)
+{
+    unsigned long long *ibitmap = (unsigned long long *) block;
+
+    memset(block, 0, block_size);
+	/* a = 1010, 0xa000 0000 0000 0000 means 1010 0000 0000 0000 ....; we go from the left most bit. */
+    ibitmap[0] = htole64(0xa000000000000000); /* we understand it is wasteful to use one entire block, because all we need is just 64 bits. we use bit 2 for root inode, and bit 0 is reserved - not sure why, but it seems inode 0 is considered as invalid by the VFS? */
+}
+
+static void fill_data_bitmap(char *block)
+{
+    unsigned long long *dbitmap = (unsigned long long *) block;
+
+    memset(block, 0, block_size);
+    /* the first 8 data blocks are already reserved. the 9th block also reserved for the root. ff8 means 1111 1111 1000, i.e., we have the leftmost 9 bits reserved. */
+    dbitmap[0] = htole64(0xff80000000000000);
+}
+
+static void fill_root_dir(char *block)
+{
+    struct audi_dir_block *dblock = (struct audi_dir_block *) block;
+
+    memset(block, 0, block_size);
+
+    /* first entry: . */
+    strncpy(dblock->entries[0].name, ".", AUDI_FILENAME_LEN);
+	dblock->entries[0].inode = AUDI_ROOT_INO;
+
+    /* second entry: .. */
+    strncpy(dblock->entries[1].name, "..", AUDI_FILENAME_LEN);
+	dblock->entries[1].inode = -1; // we don't really use this one, so we just set it to -1.
+
+	/* each dir block has 64 entries (fewer with blocks smaller than 4KB, see AUDI_DIR_SLOTS()),
+	 * the remaining entries (entry 2 to entry 63) do not matter
+	 * at this moment. */
+}
+
 /* Returns ceil(a/b) */
 static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 {
@@ -36,11 +87,24 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
     if (!sb)
         return NULL;
 
-    uint32_t nr_blocks = fstats->st_size / AUDI_BLOCK_SIZE;
-    uint32_t nr_inodes = AUDI_INODES_PER_BLOCK * AUDI_INODE_BLOCKS; /* as the chapter shows, 5 blocks reserved for the inodes, thus it is 16*5=80 inodes. */
+    uint32_t nr_blocks = fstats->st_size / block_size;
+    uint32_t nr_inodes = AUDI_INODES_PER_BLOCK(block_size) * AUDI_INODE_BLOCKS; /* as the chapter shows, 5 blocks reserved for the inodes, thus it is 16*5=80 inodes with 4KB blocks. */
+    uint32_t nr_init_inodes = AUDI_INODES_PER_BLOCK(block_size) * AUDI_ITABLE_INIT_BLOCKS;
+    /* but the inode bitmap only has 64 bits, so no more inodes than that can ever be handed out,
+     * and we should not tell statfs otherwise. */
+    if (nr_inodes > AUDI_BITMAP_BITS)
+        nr_inodes = AUDI_BITMAP_BITS;
+    if (nr_init_inodes > nr_inodes)
+        nr_init_inodes = nr_inodes;
     uint32_t nr_data_blocks =
         nr_blocks - 8; /* as the chapter shows, 56 data blocks: 64 - 1 - 1 - 1 - 5 = 56 */
 
+    char *block = malloc(block_size);
+    if (!block) {
+        free(sb);
+        return NULL;
+    }
+
     memset(sb, 0, sizeof(struct superblock));
     sb->info = (struct audi_sb_info){
         .s_magic = htole32(AUDI_MAGIC),
@@ -48,10 +112,19 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         .s_inodes_count = htole32(nr_inodes),
         .s_free_inodes_count = htole32(nr_inodes - 2), /* reserve one inode for the root inode, and inode 0 in Linux indicates the inode is invalid, thus we can't use 0. */
         .s_free_blocks_count = htole32(nr_data_blocks - 1), /* -1? because the first data block is for the root inode? */
+        .s_itable_unused = htole32(nr_inodes - nr_init_inodes), /* the kernel zeroes the rest of the inode table when it needs it. */
+        .s_features = htole32(features),
+        .s_block_size = htole32(block_size),
     };
+    fill_inode_bitmap(block);
+    sb->info.s_inode_bitmap_csum = htole32(audi_crc32c(AUDI_CRC32C_SEED, block, AUDI_INODE_BITMAP_CSUM_LEN));
+    fill_data_bitmap(block);
+    sb->info.s_data_bitmap_csum = htole32(audi_crc32c(AUDI_CRC32C_SEED, block, AUDI_DATA_BITMAP_CSUM_LEN));
+    sb->info.s_checksum = htole32(audi_sb_checksum(&sb->info));
+    free(block);
 
-    int ret = write(fd, sb, sizeof(struct superblock));
-    if (ret != sizeof(struct superblock)) {
+    int ret = write(fd, sb, block_size);
+    if (ret != block_size) {
         free(sb);
         return NULL;
     }
@@ -62,29 +135,27 @@ static struct superblock *write_superblock(int fd, struct stat *fstats)
         "\ts_blocks_count=%u\n"
         "\ts_inodes_count=%u\n"
         "\ts_free_inodes_count=%u\n"
-        "\ts_free_blocks_count=%u\n",
-        sizeof(struct superblock), sb->info.s_magic, sb->info.s_blocks_count,
+        "\ts_free_blocks_count=%u\n"
+        "\ts_itable_unused=%u\n"
+        "\ts_block_size=%u\n",
+        (long) block_size, sb->info.s_magic, sb->info.s_blocks_count,
         sb->info.s_inodes_count, sb->info.s_free_inodes_count,
-        sb->info.s_free_blocks_count);
+        sb->info.s_free_blocks_count, sb->info.s_itable_unused, sb->info.s_block_size);
 
     return sb;
 }
 
 static int write_inode_bitmap(int fd, struct superblock *sb)
 {
-    char *block = malloc(AUDI_BLOCK_SIZE);
+    char *block = malloc(block_size);
     if (!block)
         return -1;
 
     unsigned long long *ibitmap = (unsigned long long *) block;
 
-    /* Set all bits to 1 */
-    memset(ibitmap, 0x00, AUDI_BLOCK_SIZE);
-
-	/* a = 1010, 0xa000 0000 0000 0000 means 1010 0000 0000 0000 ....; we go from the left most bit. */
-    ibitmap[0] = htole64(0xa000000000000000); /* we understand it is wasteful to use one entire block, because all we need is just 64 bits. we use bit 2 for root inode, and bit 0 is reserved - not sure why, but it seems inode 0 is considered as invalid by the VFS? */
-    int ret = write(fd, ibitmap, AUDI_BLOCK_SIZE);
-    if (ret != AUDI_BLOCK_SIZE) {
+    fill_inode_bitmap(block);
+    int ret = write(fd, ibitmap, block_size);
+    if (ret != block_size) {
         ret = -1;
         goto end;
     }
@@ -101,19 +172,15 @@ end:
 
 static int write_data_bitmap(int fd, struct superblock *sb)
 {
-    char *block = malloc(AUDI_BLOCK_SIZE);
+    char *block = malloc(block_size);
     if (!block)
         return -1;
 
     unsigned long long *dbitmap = (unsigned long long *) block;
 
-    /* set all bits to 1 */
-    memset(dbitmap, 0x00, AUDI_BLOCK_SIZE);
-
-    /* the first 8 data blocks are already reserved. the 9th block also reserved for the root. ff8 means 1111 1111 1000, i.e., we have the leftmost 9 bits reserved. */
-    dbitmap[0] = htole64(0xff80000000000000);
-    int ret = write(fd, dbitmap, AUDI_BLOCK_SIZE); /* we only need 64 bits, but we still reserve and write one entire block. */
-    if (ret != AUDI_BLOCK_SIZE) {
+    fill_data_bitmap(block);
+    int ret = write(fd, dbitmap, block_size); /* we only need 64 bits, but we still reserve and write one entire block. */
+    if (ret != block_size) {
         ret = -1;
         goto end;
     }
@@ -128,12 +195,15 @@ end:
 
 static int write_inode_table(int fd, struct superblock *sb)
 {
-    /* Allocate 5 zeroed blocks for the inode table */
-    char *blocks = malloc(AUDI_BLOCK_SIZE*AUDI_INODE_BLOCKS);
-    if (!blocks)
-        return -1;
+    /* we only write the first AUDI_ITABLE_INIT_BLOCKS blocks of the inode table, which is where the root inode lives.
+     * the remaining blocks are left as they are on the disk, the kernel zeroes them lazily, see s_itable_unused in audi.h. */
+    char *blocks = malloc(block_size*AUDI_ITABLE_INIT_BLOCKS);
+    char *root_dir = malloc(block_size);
+    int ret = -1;
+    if (!blocks || !root_dir)
+        goto end;
 
-    memset(blocks, 0, AUDI_BLOCK_SIZE);
+    memset(blocks, 0, block_size*AUDI_ITABLE_INIT_BLOCKS);
 
     /* Root inode (inode 2) */
     struct audi_inode *inode = ((struct audi_inode *) blocks)+2; /* move forward 2*256=512 bytes - so as to skip inode 0 and 1, and write inode 2. */
@@ -143,25 +213,33 @@ static int write_inode_table(int fd, struct superblock *sb)
     inode->i_mode = htole32(S_IFDIR | 0755);
     inode->i_uid = htole32(1000); /* currently uid 1000 represents user cs452, or the first user in this system. */
     inode->i_gid = htole32(1000); /* gid 1000 is group cs452 */
-    inode->i_size = htole32(AUDI_BLOCK_SIZE); /* we assume every file/directory in this file system occupies one block, thus its size is always 4KB. */
+    inode->i_size = htole32(block_size); /* we assume every file/directory in this file system occupies one block, thus its size is always one block. */
     inode->i_nlink = htole32(2);
-    inode->data_block = htole32(first_data_block);
-    int ret = write(fd, blocks, AUDI_BLOCK_SIZE*AUDI_INODE_BLOCKS); /* write whatever in blocks into this file. the first block in inode table is non zero, because we have to fill in the information about inode 2. */
-    if (ret != AUDI_BLOCK_SIZE*AUDI_INODE_BLOCKS) {
+    inode->i_block[0] = htole32(first_data_block);
+    fill_root_dir(root_dir);
+    inode->i_dir_checksum = htole32(audi_crc32c(AUDI_CRC32C_SEED, root_dir, block_size));
+    inode->i_checksum = htole32(audi_inode_checksum(AUDI_ROOT_INO, inode));
+    ret = write(fd, blocks, block_size*AUDI_ITABLE_INIT_BLOCKS); /* the first block in inode table is non zero, because we have to fill in the information about inode 2. */
+    if (ret != block_size*AUDI_ITABLE_INIT_BLOCKS) {
         ret = -1;
         goto end;
     }
 
-    /* in our very simple file system, there are 5 blocks storing the inode table. */
+    /* in our very simple file system, there are 5 blocks storing the inode table; skip the ones we did not write. */
+    if (lseek(fd, (off_t) block_size*(AUDI_INODE_BLOCKS - AUDI_ITABLE_INIT_BLOCKS), SEEK_CUR) == (off_t) -1) {
+        ret = -1;
+        goto end;
+    }
 
     ret = 0;
 
     printf(
-        "inode table: wrote 5 blocks\n"
+        "inode table: wrote %d of %d blocks\n"
         "\tinode size = %ld bytes\n",
-        sizeof(struct audi_inode));
+        AUDI_ITABLE_INIT_BLOCKS, AUDI_INODE_BLOCKS, sizeof(struct audi_inode));
 
 end:
+    free(root_dir);
     free(blocks);
     return ret;
 }
@@ -169,26 +247,14 @@ end:
 static int write_data_blocks(int fd, struct superblock *sb)
 {
     /* allocate a block for the root directory */
-    struct audi_dir_block *dblock = malloc(sizeof(struct audi_dir_block));
+    char *dblock = malloc(block_size);
     if (!dblock)
         return -1;
-    memset(dblock, 0, sizeof(struct audi_dir_block));
-
-    /* first entry: . */
-    strncpy(dblock->entries[0].name, ".", AUDI_FILENAME_LEN);
-	dblock->entries[0].inode = AUDI_ROOT_INO;
-
-    /* second entry: .. */
-    strncpy(dblock->entries[1].name, "..", AUDI_FILENAME_LEN);
-	dblock->entries[1].inode = -1; // we don't really use this one, so we just set it to -1.
-
-	/* each dir block has 64 entries, 
-	 * the remaining entries (entry 2 to entry 63) do not matter
-	 * at this moment. */
+    fill_root_dir(dblock);
 
 	/* write whatever in dblock into this file */
-	int ret = write(fd, dblock, sizeof(struct audi_dir_block));
-	if (ret != AUDI_BLOCK_SIZE) {
+	int ret = write(fd, dblock, block_size);
+	if (ret != block_size) {
 		ret = -1;
 		goto end;
 	}
@@ -202,15 +268,69 @@ end:
     return ret;
 }
 
+/* tell the device that the data blocks after the root directory's block are free,
+ * so thin-provisioned images and SSDs can release them. a failure here is not fatal. */
+static void discard_data_blocks(int fd, struct stat *fstats)
+{
+    uint64_t range[2];
+    int ret;
+
+    range[0] = (uint64_t) 9 * block_size; /* blocks 0-8 are the metadata and the root directory */
+    range[1] = fstats->st_size - range[0];
+
+    if ((fstats->st_mode & S_IFMT) == S_IFBLK)
+        ret = ioctl(fd, BLKDISCARD, range);
+    else
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+    if (ret) {
+        perror("discard");
+        return;
+    }
+    printf("discarded %" PRIu64 " bytes of data blocks\n", range[1]);
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s disk\n", argv[0]);
+    int discard = 0, opt;
+    char *end;
+
+    while ((opt = getopt(argc, argv, "b:Cd")) != -1) {
+        switch (opt) {
+        case 'b':
+            block_size = strtoul(optarg, &end, 0);
+            if (*end == 'k' || *end == 'K') {
+                block_size *= 1024;
+                end++;
+            }
+            if (*end || block_size < AUDI_MIN_BLOCK_SIZE || block_size > AUDI_MAX_BLOCK_SIZE ||
+                (block_size & (block_size - 1))) {
+                fprintf(stderr, "%s: block size must be a power of 2 from %d to %d\n",
+                        optarg, AUDI_MIN_BLOCK_SIZE, AUDI_MAX_BLOCK_SIZE);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            features &= ~AUDI_FEATURE_CSUM;
+            break;
+        case 'd':
+            discard = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+usage:
+        fprintf(stderr, "Usage: %s [-b size] [-C] [-d] disk\n"
+                "\t-b\tblock size in bytes (or with a K suffix), a power of 2 from 1K to 64K, 4K by default;\n"
+                "\t\tthe kernel module only mounts it up to the page size, and only compresses at the page size\n"
+                "\t-C\tno metadata checksums\n"
+                "\t-d\tdiscard the data blocks\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     /* Open disk image */
-    int fd = open(argv[1], O_RDWR);
+    int fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("open():");
         return EXIT_FAILURE;
@@ -237,10 +357,10 @@ int main(int argc, char **argv)
         stat_buf.st_size = blk_size;
     }
 
-    /* Check if image size is 256KB - 64 blocks, 4 KB each block, thus it is 64*4=256KB */
-    if (stat_buf.st_size != 64*4*1024) {
-        fprintf(stderr, "Please make sure your image size is %ld KB)\n",
-                stat_buf.st_size/1024);
+    /* Check if image size is 64 blocks, with the default 4 KB each block, thus it is 64*4=256KB */
+    if (stat_buf.st_size != 64 * (off_t) block_size) {
+        fprintf(stderr, "Please make sure your image size is %ld KB (64 blocks of %u bytes), not %ld KB\n",
+                64 * (long) block_size / 1024, block_size, (long) stat_buf.st_size/1024);
         ret = EXIT_FAILURE;
         goto fclose;
     }
@@ -285,6 +405,9 @@ int main(int argc, char **argv)
         goto free_sb;
     }
 
+    if (discard)
+        discard_data_blocks(fd, &stat_buf);
+
 free_sb:
     free(sb);
 fclose:
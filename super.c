@@ -5,14 +5,20 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <linux/blkdev.h> /* for blk_queue_discard() */
 #include <linux/buffer_head.h> /* so we can use sb_bread() */
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/list_sort.h>
 #include <linux/module.h>
+#include <linux/parser.h> /* for match_token() */
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
+#include <linux/workqueue.h>
 
 #include "audi.h"
+#include "bitmap.h"
 
 /* either: fill_super()-> audi_iget() -> iget_locked() -> alloc_inode(sb) -> sb->s_op->alloc_inode(sb) 
  * or: fill_super() -> audi_iget() -> new_inode() -> new_inode_pseudo() -> alloc_inode(sb) -> sb->s_op->alloc_inode(sb)
@@ -25,6 +31,11 @@ static struct inode *audi_alloc_inode(struct super_block *sb)
 
 	/* not sure why, but without this line the kernel crashes when mounting the file system. */
 	inode_init_once(&ai->vfs_inode);
+	ai->dir_index = NULL;
+	ai->i_next_orphan = 0;
+	ai->i_alloc_hint = 0;
+	INIT_LIST_HEAD(&ai->i_orphan);
+	INIT_LIST_HEAD(&ai->i_reclaim);
 	/* note that we allocate memory for a struct audi_inode_info pointer,
 	 * but we return a struct inode pointer. 
 	 * plus, here we only allocate memory but we do not initialize the inode, ext2_alloc_inode() does the same. */
@@ -36,14 +47,93 @@ static void audi_destroy_inode(struct inode *inode)
 {
 	struct audi_inode_info *ai = AUDI_INODE(inode);
 	pr_info("destroy inode %ld\n", inode->i_ino);
+	audi_dir_index_free(inode);
 	kmem_cache_free(audi_inode_cachep, ai);
 }
 
-/* put_super: called when the VFS wishes to free the superblock (i.e. unmount);
- * but what memory do we need to release?? */
-//static void audi_put_super(struct super_block *sb)
-//{
-//}
+/*
+ * deferred freeing, see AUDI_MOUNT_DEFERFREE. unlink() only queues an inode which lost its last name,
+ * holding a reference to it, and returns; the worker of this file system picks up whatever has been queued
+ * after AUDI_RECLAIM_DELAY and frees it in one batch, see audi_reclaim(). the inodes stay on the orphan list
+ * until then, so if we crash, the next mount frees them instead.
+ */
+#define AUDI_RECLAIM_DELAY (HZ / 10)
+
+/* called by unlink() and rename() when inode lost its last name. */
+void audi_reclaim_queue(struct inode *inode)
+{
+	struct audi_fs_info *fsi = AUDI_FS(inode->i_sb);
+
+	if (!test_opt(inode->i_sb, DEFERFREE) || !fsi->s_reclaim_wq)
+		return;
+	ihold(inode);
+	spin_lock(&fsi->s_reclaim_lock);
+	list_add_tail(&AUDI_INODE(inode)->i_reclaim, &fsi->s_reclaim_list);
+	spin_unlock(&fsi->s_reclaim_lock);
+	/* does nothing if the work is already pending: this inode joins that batch. */
+	queue_delayed_work(fsi->s_reclaim_wq, &fsi->s_reclaim_work, AUDI_RECLAIM_DELAY);
+}
+
+/* run whatever is queued right now, and wait for it. */
+static void audi_reclaim_flush(struct super_block *sb)
+{
+	struct audi_fs_info *fsi = AUDI_FS(sb);
+
+	if (fsi->s_reclaim_wq)
+		flush_delayed_work(&fsi->s_reclaim_work);
+}
+
+/* put_super: called when the VFS wishes to free the superblock (i.e. unmount).
+ * the reclaim queue is empty by now, audi_sync_fs() has flushed it. */
+static void audi_put_super(struct super_block *sb)
+{
+	struct audi_fs_info *fsi = AUDI_FS(sb);
+
+	if (fsi->s_reclaim_wq) {
+		audi_reclaim_flush(sb);
+		destroy_workqueue(fsi->s_reclaim_wq);
+	}
+	sb->s_fs_info = NULL;
+	kfree(fsi);
+}
+
+/* copy the generic inode and our audi_inode_info into the on-disk inode disk_inode, checksum included.
+ * shared by audi_write_inode() and audi_reclaim_inode(). */
+static void audi_fill_disk_inode(struct inode *inode, struct audi_inode *disk_inode)
+{
+    struct audi_inode_info *ci = AUDI_INODE(inode);
+    struct audi_sb_info *sbi = AUDI_SB(inode->i_sb);
+    uint32_t ino = inode->i_ino;
+
+    /* update the mode using what the generic inode has.
+	 * this is the only place we actually update our audi_inode on disk. */
+    disk_inode->i_mode = inode->i_mode;
+    disk_inode->i_uid = i_uid_read(inode);
+    disk_inode->i_gid = i_gid_read(inode);
+    audi_inode_set_size(sbi, disk_inode, inode->i_size);
+    disk_inode->i_ctime = inode->i_ctime.tv_sec;
+    disk_inode->i_atime = inode->i_atime.tv_sec;
+    disk_inode->i_mtime = inode->i_mtime.tv_sec;
+    if (audi_has_inode_v2(sbi)) {
+        disk_inode->i_ctime_nsec = inode->i_ctime.tv_nsec;
+        disk_inode->i_atime_nsec = inode->i_atime.tv_nsec;
+        disk_inode->i_mtime_nsec = inode->i_mtime.tv_nsec;
+    }
+    disk_inode->i_nlink = inode->i_nlink;
+	/* the block map is unique, the generic inode doesn't have this one. */
+    memcpy(disk_inode->i_block, ci->i_block, sizeof(disk_inode->i_block));
+    disk_inode->i_flags = ci->i_flags;
+    disk_inode->i_next_orphan = ci->i_next_orphan;
+	/* the target of a fast symlink lives in the inode too, see audi_symlink(). */
+	if (S_ISLNK(inode->i_mode) && inode->i_size < AUDI_FAST_SYMLINK_LEN)
+		memcpy(disk_inode->i_symlink, ci->i_symlink, AUDI_FAST_SYMLINK_LEN);
+	/* last, the checksum covers everything above, the symlink target included. */
+	if (audi_has_csum(sbi)) {
+		if (S_ISDIR(inode->i_mode))
+			disk_inode->i_dir_checksum = ci->i_dir_checksum;
+		disk_inode->i_checksum = audi_inode_checksum(ino, disk_inode);
+	}
+}
 
 /* this method is called when the VFS needs to write an
  * inode to disc. The second parameter indicates whether the write
@@ -54,13 +144,12 @@ static void audi_destroy_inode(struct inode *inode)
 static int audi_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
     struct audi_inode *disk_inode;
-    struct audi_inode_info *ci = AUDI_INODE(inode);
     struct super_block *sb = inode->i_sb;
     struct audi_sb_info *sbi = AUDI_SB(sb);
     struct buffer_head *bh;
     uint32_t ino = inode->i_ino;
-    uint32_t inode_block = (ino / AUDI_INODES_PER_BLOCK) + 3; /* inode table starts at block 3 */
-    uint32_t inode_shift = ino % AUDI_INODES_PER_BLOCK;
+    uint32_t inode_block = (ino / AUDI_INODES_PER_BLOCK(sb->s_blocksize)) + 3; /* inode table starts at block 3 */
+    uint32_t inode_shift = ino % AUDI_INODES_PER_BLOCK(sb->s_blocksize);
 
     pr_info("writing inode %d at block %d\n", ino, inode_block);
     if (ino >= sbi->s_inodes_count)
@@ -74,85 +163,204 @@ static int audi_write_inode(struct inode *inode, struct writeback_control *wbc)
     disk_inode = (struct audi_inode *) bh->b_data;
     disk_inode += inode_shift;
 
-    /* update the mode using what the generic inode has.
-	 * this is the only place we actually update our audi_inode on disk. */
-    disk_inode->i_mode = inode->i_mode;
-    disk_inode->i_uid = i_uid_read(inode);
-    disk_inode->i_gid = i_gid_read(inode);
-    disk_inode->i_size = inode->i_size;
-    disk_inode->i_ctime = inode->i_ctime.tv_sec;
-    disk_inode->i_atime = inode->i_atime.tv_sec;
-    disk_inode->i_mtime = inode->i_mtime.tv_sec;
-    disk_inode->i_nlink = inode->i_nlink;
-	/* this field is unique, the generic inode doesn't have this one. */
-    disk_inode->data_block = ci->data_block;
+    audi_fill_disk_inode(inode, disk_inode);
 
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+	/* like ext2, only wait for the disk when asked to, e.g. fsync() or sync;
+	 * otherwise the buffer goes out with the rest of the inode table block. */
+    if (wbc && wbc->sync_mode == WB_SYNC_ALL)
+        sync_dirty_buffer(bh);
     brelse(bh);
     pr_info("writing inode finished\n");
 
     return 0;
 }
 
+/* sort a reclaim batch by inode number, so the inodes sharing an inode table block come one after another. */
+static int audi_reclaim_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct audi_inode_info *x = list_entry(a, struct audi_inode_info, i_reclaim);
+	struct audi_inode_info *y = list_entry(b, struct audi_inode_info, i_reclaim);
+
+	if (x->vfs_inode.i_ino < y->vfs_inode.i_ino)
+		return -1;
+	return x->vfs_inode.i_ino > y->vfs_inode.i_ino;
+}
+
+/*
+ * the reclaim worker: free a batch of queued inodes at once. we just let go of each inode, in inode number order.
+ * when ours was the last reference, audi_evict_inode() runs right here, in the worker, and hands the inode
+ * to audi_reclaim_inode(): its blocks and its inode number are collected for the whole batch, and it is written
+ * into the inode table block the batch holds, so each block of the inode table is read and dirtied once
+ * per batch, not once per inode. the bitmaps are then updated once at the end.
+ * whoever else still holds an inode drops the last reference later, and evict frees it as usual;
+ * the VFS decides who that is, so we never look at i_count ourselves.
+ */
+static void audi_reclaim(struct work_struct *work)
+{
+	struct audi_fs_info *fsi = container_of(to_delayed_work(work), struct audi_fs_info, s_reclaim_work);
+	struct audi_inode_info *ai, *tmp;
+	LIST_HEAD(batch);
+
+	spin_lock(&fsi->s_reclaim_lock);
+	list_splice_init(&fsi->s_reclaim_list, &batch);
+	spin_unlock(&fsi->s_reclaim_lock);
+	list_sort(NULL, &batch, audi_reclaim_cmp);
+
+	fsi->s_reclaimer = current;
+	list_for_each_entry_safe(ai, tmp, &batch, i_reclaim) {
+		list_del_init(&ai->i_reclaim);
+		iput(&ai->vfs_inode);
+	}
+	fsi->s_reclaimer = NULL;
+
+	if (fsi->s_reclaim_bh) {
+		mark_buffer_dirty(fsi->s_reclaim_bh);
+		brelse(fsi->s_reclaim_bh);
+		fsi->s_reclaim_bh = NULL;
+	}
+	put_blocks(fsi, fsi->s_reclaim_blocks);
+	put_inodes(fsi, fsi->s_reclaim_inodes);
+	fsi->s_reclaim_blocks = fsi->s_reclaim_inodes = 0;
+}
+
+/* audi_evict_inode() of an inode audi_reclaim() let go of: free it as part of the batch in progress. */
+static void audi_reclaim_inode(struct audi_fs_info *fsi, struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	uint32_t inode_block;
+
+	pr_info("reclaim inode %ld\n", inode->i_ino);
+	audi_release_inode(inode, &fsi->s_reclaim_blocks, &fsi->s_reclaim_inodes);
+	if (inode->i_ino >= fsi->s_sbi->s_inodes_count)
+		return;
+	inode_block = (inode->i_ino / AUDI_INODES_PER_BLOCK(sb->s_blocksize)) + 3; /* inode table starts at block 3 */
+	if (!fsi->s_reclaim_bh || fsi->s_reclaim_bh->b_blocknr != inode_block) {
+		if (fsi->s_reclaim_bh) {
+			mark_buffer_dirty(fsi->s_reclaim_bh);
+			brelse(fsi->s_reclaim_bh);
+		}
+		fsi->s_reclaim_bh = sb_bread(sb, inode_block);
+	}
+	if (fsi->s_reclaim_bh)
+		audi_fill_disk_inode(inode, (struct audi_inode *) fsi->s_reclaim_bh->b_data +
+								inode->i_ino % AUDI_INODES_PER_BLOCK(sb->s_blocksize));
+}
+
+/* called when the last reference to an inode is dropped and it leaves the inode cache, like ext2_evict_inode().
+ * an inode without any name left is deleted here, not in unlink(): until now, someone still had it open. */
+static void audi_evict_inode(struct inode *inode)
+{
+	struct audi_fs_info *fsi = AUDI_FS(inode->i_sb);
+	unsigned long long blocks = 0, inodes = 0;
+	struct writeback_control wbc = {
+		.sync_mode = inode_needs_sync(inode) ? WB_SYNC_ALL : WB_SYNC_NONE,
+	};
+
+	pr_info("evict inode %ld\n", inode->i_ino);
+	truncate_inode_pages(&inode->i_data, 0);
+	if (!inode->i_nlink && !is_bad_inode(inode) && fsi->s_reclaimer == current) {
+		/* the last reference was the one audi_reclaim() held. */
+		audi_reclaim_inode(fsi, inode);
+	} else if (!inode->i_nlink && !is_bad_inode(inode)) {
+		audi_release_inode(inode, &blocks, &inodes);
+		put_blocks(fsi, blocks);
+		put_inodes(fsi, inodes);
+		audi_write_inode(inode, &wbc);
+	}
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+}
+
 /* this function is called when umount the file system,
  * and this is the moment when the super block on disk will be updated,
  * and the bitmaps will be updated on disk. */
 static int audi_sync_fs(struct super_block *sb, int wait)
 {
-	struct audi_sb_info *sbi = AUDI_SB(sb);
+	struct audi_fs_info *fsi = AUDI_FS(sb);
+	struct audi_sb_info *sbi = fsi->s_sbi;
 	struct audi_sb_info *disk_sb;
 	struct buffer_head *bh;
 	unsigned long long *bitmap;
 
 	pr_info("sync fs is called\n");
-	/* flush superblock, which is block 0 */
-	bh = sb_bread(sb, 0);
-	if (!bh)
-	return -EIO;
-
-	disk_sb = (struct audi_sb_info *) bh->b_data;
-
-	disk_sb->s_blocks_count = sbi->s_blocks_count;
-	disk_sb->s_inodes_count = sbi->s_inodes_count;
-	disk_sb->s_free_inodes_count = sbi->s_free_inodes_count;
-	disk_sb->s_free_blocks_count = sbi->s_free_blocks_count;
-
-	mark_buffer_dirty(bh);
+	/* sync, and umount, give the space of the queued inodes back first. */
 	if (wait)
-		sync_dirty_buffer(bh);
-	brelse(bh);
-
+		audi_reclaim_flush(sb);
+	/* the bitmaps go first: the superblock has their checksums. */
 	/* flush inode bitmap, which is block 1 */
 	bh = sb_bread(sb, 1);
 	if (!bh)
 		return -EIO;
 
 	/* turns out this pointer (bitmap) is needed. 
-	 * if we just assign inode_bitmap to *bh->b_data, it won't work. */
-	pr_info("sync fs: updating inode bitmap to 0x%llx\n", inode_bitmap);
+	 * if we just assign the inode bitmap to *bh->b_data, it won't work. */
+	pr_info("sync fs: updating inode bitmap to 0x%llx\n", fsi->s_inode_bitmap);
 	bitmap = (unsigned long long *) bh->b_data;
-	*bitmap = inode_bitmap;
+	*bitmap = fsi->s_inode_bitmap;
+	if (audi_has_csum(sbi))
+		sbi->s_inode_bitmap_csum = audi_crc32c(AUDI_CRC32C_SEED, bh->b_data, AUDI_INODE_BITMAP_CSUM_LEN);
 
 	mark_buffer_dirty(bh);
 	if (wait)
 		sync_dirty_buffer(bh);
 	brelse(bh);
 
-	pr_info("sync fs: updating data bitmap to 0x%llx\n", data_bitmap);
+	pr_info("sync fs: updating data bitmap to 0x%llx\n", fsi->s_data_bitmap);
 	/* flush data bitmap, which is block 2 */
 	bh = sb_bread(sb, 2);
 	if (!bh)
 		return -EIO;
 
 	bitmap = (unsigned long long *) bh->b_data;
-	*bitmap = data_bitmap;
+	*bitmap = fsi->s_data_bitmap;
+	memcpy(bh->b_data + AUDI_REFCOUNT_OFFSET, fsi->s_data_refcount, sizeof(fsi->s_data_refcount));
+	if (audi_has_csum(sbi))
+		sbi->s_data_bitmap_csum = audi_crc32c(AUDI_CRC32C_SEED, bh->b_data, AUDI_DATA_BITMAP_CSUM_LEN);
 
 	mark_buffer_dirty(bh);
 	if (wait)
 		sync_dirty_buffer(bh);
 	brelse(bh);
 
+	/* flush superblock, which is block 0 */
+	bh = sb_bread(sb, 0);
+	if (!bh)
+	return -EIO;
+
+	disk_sb = (struct audi_sb_info *) bh->b_data;
+
+	disk_sb->s_blocks_count = sbi->s_blocks_count;
+	disk_sb->s_inodes_count = sbi->s_inodes_count;
+	disk_sb->s_free_inodes_count = sbi->s_free_inodes_count;
+	disk_sb->s_free_blocks_count = sbi->s_free_blocks_count;
+	disk_sb->s_itable_unused = sbi->s_itable_unused;
+	disk_sb->s_features = sbi->s_features;
+	disk_sb->s_inode_bitmap_csum = sbi->s_inode_bitmap_csum;
+	disk_sb->s_data_bitmap_csum = sbi->s_data_bitmap_csum;
+	disk_sb->s_last_orphan = sbi->s_last_orphan;
+	if (audi_has_csum(sbi))
+		disk_sb->s_checksum = audi_sb_checksum(disk_sb);
+
+	mark_buffer_dirty(bh);
+	if (wait)
+		sync_dirty_buffer(bh);
+	brelse(bh);
+
+	/* now that the data bitmap says these blocks are free, tell the device about them too.
+	 * we do this in one batch here rather than in put_blocks(), so freeing a block stays cheap. */
+	if (test_opt(sb, DISCARD) && fsi->s_discard_bitmap) {
+		uint64_t trimmed = 0;
+		unsigned long long blocks;
+
+		spin_lock(&fsi->s_bitmap_lock);
+		blocks = fsi->s_discard_bitmap;
+		fsi->s_discard_bitmap = 0;
+		spin_unlock(&fsi->s_bitmap_lock);
+		if (audi_discard_free_blocks(sb, blocks, 1, &trimmed))
+			pr_info("sync fs: discard failed\n");
+	}
+
 	pr_info("sync fs finished\n");
 	return 0;
 }
@@ -167,7 +375,7 @@ static int audi_statfs(struct dentry *dentry, struct kstatfs *stat)
 
     pr_info("statfs is called\n");
     stat->f_type = AUDI_MAGIC;
-    stat->f_bsize = AUDI_BLOCK_SIZE;
+    stat->f_bsize = sb->s_blocksize;
     stat->f_blocks = sbi->s_blocks_count; // this is the maximum.
     stat->f_bfree = sbi->s_free_blocks_count; // this is what's remaining.
     stat->f_bavail = sbi->s_free_blocks_count;	// we consider f_bfree and f_bavail as the same.
@@ -178,15 +386,87 @@ static int audi_statfs(struct dentry *dentry, struct kstatfs *stat)
     return 0;
 }
 
+/* show our mount options in /proc/mounts. */
+static int audi_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+
+	if (test_opt(sb, DISCARD))
+		seq_puts(seq, ",discard");
+	if (test_opt(sb, COMPRESS))
+		seq_puts(seq, ",compress");
+	if (test_opt(sb, DEFERFREE))
+		seq_puts(seq, ",deferfree");
+	return 0;
+}
+
 static const struct super_operations audi_super_ops = {
-//    .put_super = audi_put_super,
+    .put_super = audi_put_super,
     .alloc_inode = audi_alloc_inode,
     .destroy_inode = audi_destroy_inode,
     .write_inode = audi_write_inode,
+    .evict_inode = audi_evict_inode,
     .sync_fs = audi_sync_fs,
     .statfs = audi_statfs,
+    .show_options = audi_show_options,
+};
+
+enum {
+	Opt_discard, Opt_nodiscard, Opt_compress, Opt_nocompress, Opt_deferfree, Opt_nodeferfree, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_compress, "compress"},
+	{Opt_nocompress, "nocompress"},
+	{Opt_deferfree, "deferfree"},
+	{Opt_nodeferfree, "nodeferfree"},
+	{Opt_err, NULL}
 };
 
+/* parse the mount options, e.g., "mount -o loop,discard -t audi test.img test".
+ * return 1 on success, 0 if there is an option we do not know about. */
+static int parse_options(char *options, struct super_block *sb)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	int token;
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_discard:
+			set_opt(sb, DISCARD);
+			break;
+		case Opt_nodiscard:
+			clear_opt(sb, DISCARD);
+			break;
+		case Opt_compress:
+			set_opt(sb, COMPRESS);
+			break;
+		case Opt_nocompress:
+			clear_opt(sb, COMPRESS);
+			break;
+		case Opt_deferfree:
+			set_opt(sb, DEFERFREE);
+			break;
+		case Opt_nodeferfree:
+			clear_opt(sb, DEFERFREE);
+			break;
+		default:
+			pr_info("error: unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
 /* this function will be called when mounting the file system.
  * this function reads the superblock information from disk, and fill the struct super_block - this structure is defined in include/linux/fs.h.
  * if successful, return 0; 
@@ -198,12 +478,27 @@ int audi_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head * bh;
 	struct audi_sb_info * sbi;
+	struct audi_fs_info * fsi;
 	/* representing the root inode */
 	struct inode *root;
+	uint32_t blocksize;
 	long ret = -EINVAL;
 	pr_info("file system mounted at %s\n", sb->s_id);
     pr_info("fill super block\n");
 
+	fsi = kzalloc(sizeof(*fsi), GFP_KERNEL);
+	if (!fsi)
+		return -ENOMEM;
+	spin_lock_init(&fsi->s_bitmap_lock);
+	mutex_init(&fsi->s_itable_mutex);
+	INIT_LIST_HEAD(&fsi->s_orphans);
+	mutex_init(&fsi->s_orphan_mutex);
+	INIT_LIST_HEAD(&fsi->s_reclaim_list);
+	spin_lock_init(&fsi->s_reclaim_lock);
+	INIT_DELAYED_WORK(&fsi->s_reclaim_work, audi_reclaim);
+	/* in struct super_block, there is "void  *s_fs_info;" commented as "filesystem private info". */
+	sb->s_fs_info = fsi;
+
 	/* read block 0, as that's our superblock; and we do not need to allocate memory for bh, 
 	 * and sb_bread() reads the block and stores the data in bh->b_data, and the block size is stored in bh->b_size. */
 	if (!(bh = sb_bread(sb, 0))) {
@@ -216,30 +511,75 @@ int audi_fill_super(struct super_block *sb, void *data, int silent)
 	 * FIXME: but then how do we free the memory?? */
 	sbi = (struct audi_sb_info *) ((char *)bh->b_data);
 
-	/* in struct super_block, there is "void  *s_fs_info;" commented as "filesystem private info". 
-	 * this line must be after the above line, which sets sbi. */
-	sb->s_fs_info = sbi;
+	/* this line must be after the above line, which sets sbi. */
+	fsi->s_sbi = sbi;
 
 	/* le32_to_cpu() converts a 32-bit little-endian integer to its 32-bit representation on the current CPU. 
 	 * ext2 uses a 16-bit magic number 0xEF53, but we use a 32-bit magic number, the s_magic is an unsigned long variable. */
 	sb->s_magic = le32_to_cpu(sbi->s_magic);
 	if (sb->s_magic != AUDI_MAGIC)
 		goto cantfind_audi;
+	if (le32_to_cpu(sbi->s_features) & ~AUDI_FEATURE_ALL) {
+		pr_info("error: unknown features 0x%x\n", le32_to_cpu(sbi->s_features) & ~AUDI_FEATURE_ALL);
+		goto failed_mount;
+	}
+	if (audi_has_csum(sbi) && sbi->s_checksum != audi_sb_checksum(sbi)) {
+		pr_info("error: superblock checksum mismatch\n");
+		goto failed_mount;
+	}
+
+	if (!parse_options((char *) data, sb))
+		goto failed_mount;
+	if (test_opt(sb, DISCARD) && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		pr_info("mounting with \"discard\" option, but the device does not support discard\n");
+		clear_opt(sb, DISCARD);
+	}
+	if (test_opt(sb, COMPRESS) && !audi_compr_algo()) {
+		pr_info("mounting with \"compress\" option, but neither lz4 nor lzo is available\n");
+		clear_opt(sb, COMPRESS);
+	}
 
-	/* set sb->s_blocksize to AUDI_BLOCK_SIZE, which is 4KB, as defined in audi.h. 
-	 * question: do we need to call this sb_set_blocksize(sb, AUDI_BLOCK_SIZE);? */
-	sb->s_blocksize = AUDI_BLOCK_SIZE;
-	if (sb->s_blocksize != bh->b_size) {
+	/* the superblock is at byte 0 whatever the block size is, so we could read it with the block size of the device;
+	 * now switch to the block size mkfs chose, and read it again: sb_set_blocksize() drops the buffers we read so far,
+	 * so sbi must point into the new buffer. the page cache needs a block to fit in a page, hence the PAGE_SIZE limit. */
+	blocksize = audi_block_size(sbi);
+	if (!is_power_of_2(blocksize) || blocksize < AUDI_MIN_BLOCK_SIZE || blocksize > AUDI_MAX_BLOCK_SIZE) {
+		pr_info("error: invalid blocksize %u\n", blocksize);
+		goto failed_mount;
+	}
+	if (blocksize > PAGE_SIZE) {
 		if (!silent)
-			pr_info("error: unsupported blocksize");
+			pr_info("error: blocksize %u is larger than the page size %lu\n", blocksize, PAGE_SIZE);
 		goto failed_mount;
 	}
+	if (blocksize != bh->b_size) {
+		brelse(bh);
+		bh = NULL;
+		if (!sb_set_blocksize(sb, blocksize)) {
+			pr_info("error: unsupported blocksize %u\n", blocksize);
+			goto failed_sbi;
+		}
+		if (!(bh = sb_bread(sb, 0))) {
+			pr_info("error: unable to read superblock");
+			goto failed_sbi;
+		}
+		sbi = (struct audi_sb_info *) ((char *)bh->b_data);
+		fsi->s_sbi = sbi;
+	}
+	sb->s_blocksize = blocksize;
+	if (test_opt(sb, COMPRESS) && blocksize != PAGE_CACHE_SIZE) {
+		pr_info("mounting with \"compress\" option, but compression needs the blocksize to be the page size\n");
+		clear_opt(sb, COMPRESS);
+	}
 
-	sb->s_maxbytes = AUDI_MAX_FILESIZE; /* as of now, we only use 1 direct pointer, which points to one block, thus the max file size is 4KB */
+	/* a version 1 inode only keeps whole seconds, so the times in memory must not be any finer than that,
+	 * otherwise they change when the inode is read back. */
+	sb->s_time_gran = audi_has_inode_v2(sbi) ? 1 : NSEC_PER_SEC;
+	sb->s_maxbytes = AUDI_MAX_FILESIZE(blocksize); /* as of now, we only use AUDI_N_BLOCKS direct pointers, each points to one block, thus the max file size is 8 blocks */
 	sb->s_op = &audi_super_ops;
     brelse(bh); /* decrement a buffer_head's reference count */
 
-	/* read inode_bitmap, ext2 doesn't do it here because they have a bitmap for each block group, we only have one block group. */
+	/* read the inode bitmap, ext2 doesn't do it here because they have a bitmap for each block group, we only have one block group. */
 	/* in audi file system, the inode bitmap is right after the super block, thus it's block 1. */
 	bh = sb_bread(sb, 1);
 	if (!bh) {
@@ -247,21 +587,36 @@ int audi_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed_sbi;
 	}
 
-	inode_bitmap = *(unsigned long long *)(bh->b_data);
-	pr_info("inode bitmap is 0x%llx\n", inode_bitmap);
+	if (audi_has_csum(sbi) &&
+		sbi->s_inode_bitmap_csum != audi_crc32c(AUDI_CRC32C_SEED, bh->b_data, AUDI_INODE_BITMAP_CSUM_LEN)) {
+		pr_info("error: inode bitmap checksum mismatch\n");
+		brelse(bh);
+		ret = -EIO;
+		goto failed_sbi;
+	}
+	fsi->s_inode_bitmap = *(unsigned long long *)(bh->b_data);
+	pr_info("inode bitmap is 0x%llx\n", fsi->s_inode_bitmap);
 	brelse(bh); /* decrement a buffer_head's reference count */
 
-    /* read inode_bitmap, ext2 doesn't do it here because they have a bitmap for each block group, we only have one block group. */
+    /* read the data bitmap, ext2 doesn't do it here because they have a bitmap for each block group, we only have one block group. */
     /* in audi file system, the data bitmap block is right after the inode bitmap block, thus it's block 2. */
 	bh = sb_bread(sb, 2);
 	if (!bh) {
 		ret = -EIO;
 		goto failed_sbi;
 	}
-	data_bitmap = *(unsigned long long *)(bh->b_data);
+	if (audi_has_csum(sbi) &&
+		sbi->s_data_bitmap_csum != audi_crc32c(AUDI_CRC32C_SEED, bh->b_data, AUDI_DATA_BITMAP_CSUM_LEN)) {
+		pr_info("error: data bitmap checksum mismatch\n");
+		brelse(bh);
+		ret = -EIO;
+		goto failed_sbi;
+	}
+	fsi->s_data_bitmap = *(unsigned long long *)(bh->b_data);
+	memcpy(fsi->s_data_refcount, bh->b_data + AUDI_REFCOUNT_OFFSET, sizeof(fsi->s_data_refcount));
 	/* the below line should print 0x1ff, 
 	 * as that's our initial data bitmap, 9 blocks reserved already. */
-	pr_info("data bitmap is 0x%llx\n", data_bitmap);
+	pr_info("data bitmap is 0x%llx\n", fsi->s_data_bitmap);
 	brelse(bh); /* decrement a buffer_head's reference count */
 
 	/* create root inode: create means create its data structure in the memory, 
@@ -293,6 +648,20 @@ int audi_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed_sbi;
 	}
 
+	/* one worker per mounted file system, see audi_reclaim(). */
+	if (test_opt(sb, DEFERFREE) && !(fsi->s_reclaim_wq = alloc_ordered_workqueue("audi-reclaim", 0))) {
+		pr_info("mounting with \"deferfree\" option, but can not create the reclaim workqueue\n");
+		clear_opt(sb, DEFERFREE);
+	}
+
+	/* inodes which were unlinked while open when we went down, see s_last_orphan in audi.h. */
+	if (sbi->s_last_orphan) {
+		if (sb->s_flags & MS_RDONLY)
+			pr_info("read-only mount, leaving the orphan list alone\n");
+		else
+			audi_orphan_cleanup(sb);
+	}
+
     pr_info("super block filled\n");
 
     return 0;
@@ -304,6 +673,7 @@ failed_mount:
 	brelse(bh);
 failed_sbi:
 	sb->s_fs_info = NULL;
+	kfree(fsi);
 	return ret;
 }
 
@@ -0,0 +1,40 @@
+/**
+ * symlink.c - in this file we implement symbolic links.
+ * this file is mainly mimicking fs/ext2/symlink.c.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/namei.h>
+
+#include "audi.h"
+
+/* a fast symlink keeps its target in the inode, audi_iget() already copied it into memory. */
+static void *audi_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+	struct audi_inode_info *ai = AUDI_INODE(dentry->d_inode);
+
+	nd_set_link(nd, ai->i_symlink);
+	return NULL;
+}
+
+/* a slow symlink keeps its target in its data block, which we read through the page cache. */
+const struct inode_operations audi_symlink_inode_ops = {
+	.readlink = generic_readlink,
+	.follow_link = page_follow_link_light,
+	.put_link = page_put_link,
+	.getattr = simple_getattr,
+};
+
+const struct inode_operations audi_fast_symlink_inode_ops = {
+	.readlink = generic_readlink,
+	.follow_link = audi_follow_link,
+	.getattr = simple_getattr,
+};
+
+/* vim: set ts=4: */
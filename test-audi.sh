@@ -64,3 +64,403 @@ ls -a
 rm -rf ddd
 echo "after deletion we now have:"
 ls -a
+
+echo ""
+echo "testing libaudi: test-libaudi fills a new image, /tmp/audi-test.img, without the kernel module:"
+dd if=/dev/zero of=/tmp/audi-test.img bs=4K count=64 2>/dev/null
+../mkfs.audi /tmp/audi-test.img > /dev/null
+../test-libaudi /tmp/audi-test.img
+echo "mounting it on /tmp/audi-test, the kernel module must see the same thing:"
+mkdir -p /tmp/audi-test
+sudo mount -o loop -t audi /tmp/audi-test.img /tmp/audi-test
+ls -l /tmp/audi-test/lib
+cat /tmp/audi-test/lib/hello
+sudo umount /tmp/audi-test
+rm -rf /tmp/audi-test /tmp/audi-test.img
+
+echo ""
+echo "testing fsck.audi on a new image, /tmp/audi-test.img, filled by test-libaudi, then corrupted:"
+echo "the free block count in the superblock becomes 7, and every block is marked used in the data bitmap."
+dd if=/dev/zero of=/tmp/audi-test.img bs=4K count=64 2>/dev/null
+../mkfs.audi /tmp/audi-test.img > /dev/null
+../test-libaudi /tmp/audi-test.img > /dev/null
+printf '\x07\x00\x00\x00' | dd of=/tmp/audi-test.img bs=1 seek=16 conv=notrunc 2>/dev/null
+printf '\xff\xff\xff\xff\xff\xff\xff\xff' | dd of=/tmp/audi-test.img bs=1 seek=8192 conv=notrunc 2>/dev/null
+echo "fsck.audi -n must find both problems, and the checksum mismatches they cause, and fix nothing:"
+../fsck.audi -n /tmp/audi-test.img | grep -v "^phase"
+echo "fsck.audi -y must fix them all:"
+../fsck.audi -y /tmp/audi-test.img | grep -v "^phase"
+echo "fsck.audi -n must now find nothing:"
+../fsck.audi -n /tmp/audi-test.img | grep -v "^phase"
+echo "now lib/hello (inode 3) points at the block of lib (inode 1), fsck.audi -y must give it to the directory, twice the same way:"
+dd if=/tmp/audi-test.img of=/tmp/audi-test.blk bs=1 skip=$((12288 + 256 + 32)) count=4 2>/dev/null
+dd if=/tmp/audi-test.blk of=/tmp/audi-test.img bs=1 seek=$((12288 + 3 * 256 + 32)) conv=notrunc 2>/dev/null
+cp /tmp/audi-test.img /tmp/audi-test.img.orig
+../fsck.audi -y /tmp/audi-test.img | grep -v "^phase"
+../fsck.audi -y /tmp/audi-test.img.orig > /dev/null
+cmp /tmp/audi-test.img /tmp/audi-test.img.orig && echo "both repairs agree"
+rm -f /tmp/audi-test.img /tmp/audi-test.img.orig /tmp/audi-test.blk
+
+echo ""
+echo "testing that libaudi does not re-sign what it did not change: the owner of lib/hello changes behind its back,"
+echo "then test-libaudi opens the image for writing again, fails to create lib, and closes it."
+dd if=/dev/zero of=/tmp/audi-test.img bs=4K count=64 2>/dev/null
+../mkfs.audi /tmp/audi-test.img > /dev/null
+../test-libaudi /tmp/audi-test.img > /dev/null
+printf '\x07' | dd of=/tmp/audi-test.img bs=1 seek=$((12288 + 3 * 256 + 4)) conv=notrunc 2>/dev/null
+../test-libaudi /tmp/audi-test.img
+echo "fsck.audi -n must still find the checksum mismatch of inode 3:"
+../fsck.audi -n /tmp/audi-test.img | grep -v "^phase"
+rm -f /tmp/audi-test.img
+
+echo ""
+echo "testing lazy inode table initialization: /tmp/audi-test.img starts out as random bytes, and mkfs.audi only writes the first inode-table block:"
+head -c 262144 /dev/urandom > /tmp/audi-test.img
+../mkfs.audi -d /tmp/audi-test.img | grep "itable_unused\|inode table\|discarded"
+echo "mkfs.audi -d punched a hole over the data blocks, so the image uses less than 256KB on disk:"
+du -k /tmp/audi-test.img
+echo "creating 40 files, their inodes go past the first inode-table block, into blocks the kernel zeroes first:"
+mkdir -p /tmp/audi-test
+sudo mount -o loop -t audi /tmp/audi-test.img /tmp/audi-test
+sudo touch /tmp/audi-test/file{1..40}
+ls /tmp/audi-test | wc -l
+sudo umount /tmp/audi-test
+echo "fsck.audi -n must find no garbage in the inode table:"
+../fsck.audi -n /tmp/audi-test.img | grep -v "^phase"
+rm -rf /tmp/audi-test /tmp/audi-test.img
+
+echo ""
+echo "testing online discard, on a new image, /tmp/audi-test.img, mounted with -o discard:"
+dd if=/dev/zero of=/tmp/audi-test.img bs=4K count=64 2>/dev/null
+../mkfs.audi /tmp/audi-test.img > /dev/null
+mkdir -p /tmp/audi-test
+sudo mount -o loop,discard -t audi /tmp/audi-test.img /tmp/audi-test
+grep /tmp/audi-test /proc/mounts
+echo "writing 20 files of 4KB each, the image then uses about 80KB more on disk:"
+for f in {1..20}; do head -c 4096 /dev/urandom | sudo tee /tmp/audi-test/file$f > /dev/null; done
+sync
+du -k /tmp/audi-test.img
+echo "deleting them, the freed blocks are discarded when the file system syncs, so the image uses less again:"
+sudo rm -f /tmp/audi-test/file*
+sync
+du -k /tmp/audi-test.img
+sudo umount /tmp/audi-test
+echo ""
+echo "testing fstrim (FITRIM), on the same image mounted without -o discard, deleting does not shrink the image:"
+sudo mount -o loop -t audi /tmp/audi-test.img /tmp/audi-test
+for f in {1..20}; do head -c 4096 /dev/urandom | sudo tee /tmp/audi-test/file$f > /dev/null; done
+sync
+sudo rm -f /tmp/audi-test/file*
+sync
+du -k /tmp/audi-test.img
+echo "but fstrim does:"
+sudo fstrim -v /tmp/audi-test
+du -k /tmp/audi-test.img
+sudo umount /tmp/audi-test
+rm -rf /tmp/audi-test /tmp/audi-test.img
+
+echo ""
+echo "testing cached lookups: abc does not exist, so looking it up twice leaves a negative dentry:"
+ls abc
+ls abc
+echo "creating abc must turn that dentry positive, so abc is found now:"
+touch abc
+ls abc
+echo "deleting abc, it must be gone again:"
+rm -f abc
+ls abc
+echo "a name of exactly 60 bytes has no terminator on disk, it must be found, and deleted:"
+touch mymomsaysthisfileistoolongwhydowecreateafilewithsuchalongnam
+ls mymomsaysthisfileistoolongwhydowecreateafilewithsuchalongnam
+rm -f mymomsaysthisfileistoolongwhydowecreateafilewithsuchalongnam
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing stable readdir cookies: creating file00 to file19 in directory ddd:"
+mkdir ddd
+touch ddd/file{00..19}
+echo "reading 10 entries, saving the position with telldir, deleting file00 to file04, then going back with seekdir;"
+echo "the entries read after seekdir must be the ones read after telldir:"
+perl -e 'opendir(D, "ddd") or die; readdir D for 1 .. 10; $pos = telldir D; @before = readdir D;
+    unlink map { sprintf "ddd/file%02d", $_ } 0 .. 4; seekdir D, $pos; @after = readdir D;
+    print "before: @before\nafter:  @after\n", "@before" eq "@after" ? "same\n" : "different\n"'
+echo "creating new, it takes the first free slot, ls -f lists the directory in slot order:"
+touch ddd/new
+ls -f ddd
+rm -rf ddd
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing directory readahead: listing ddd with 30 entries, right after the page cache is dropped:"
+mkdir ddd
+touch ddd/file{01..30}
+sync
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+ls ddd | wc -l
+echo "and again, now from the cache:"
+ls ddd | wc -l
+rm -rf ddd
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing inode-table prefetch: ls -l of 40 files right after the page cache is dropped;"
+echo "the loop device must see a handful of reads, not one per file (the first field of its stat file):"
+mkdir ddd
+touch ddd/file{01..40}
+sync
+loop=$(awk -v dir="$(pwd)" '$2 == dir { print $1 }' /proc/mounts)
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+reads=$(awk '{ print $1 }' /sys/block/${loop#/dev/}/stat)
+ls -l ddd | wc -l
+echo "$(( $(awk '{ print $1 }' /sys/block/${loop#/dev/}/stat) - reads )) reads"
+rm -rf ddd
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing the directory name index: filling ddd with 50 files:"
+mkdir ddd
+touch ddd/file{01..50}
+ls ddd | wc -l
+echo "deleting the odd ones, then looking up file31 (deleted) and file32 (still there):"
+rm -f ddd/file{01..49..2}
+ls ddd/file31 ddd/file32
+echo "creating file31 again, the index must find it, and ddd must have 26 files:"
+touch ddd/file31
+ls ddd/file31
+ls ddd | wc -l
+echo "dropping the caches, which frees the index, the lookups must give the same answers:"
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+ls ddd/file29 ddd/file31 ddd/file32
+rm -rf ddd
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing lookups of names sharing a long prefix (the first 8 bytes do not tell them apart):"
+touch logfile-2023-01-01-aaa logfile-2023-01-01-aab logfile-2023-01-01-aba
+touch mymomsaysthisfileistoolongwhydowecreateafilewithsuchalongnam
+echo "now we have:"
+ls -a
+echo "deleting logfile-2023-01-01-aab, the other two must still be there:"
+rm -f logfile-2023-01-01-aab
+ls logfile-2023-01-01-aaa logfile-2023-01-01-aba
+echo "looking up logfile-2023-01-01-aa, which is a prefix of an existing name, but does not exist:"
+ls logfile-2023-01-01-aa
+rm -f logfile-2023-01-01-aaa logfile-2023-01-01-aba mymomsaysthisfileistoolongwhydowecreateafilewithsuchalongnam
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing rename with mv (no data is copied, so the inode numbers must not change):"
+mkdir src dst
+echo "hello" > src/abc
+echo "world" > src/bbc
+echo "before renaming we have (ls -i src):"
+ls -i src
+echo "renaming src/abc to src/abd, in the same directory:"
+mv src/abc src/abd
+ls -i src
+echo "moving src/abd to dst/abd, across directories:"
+mv src/abd dst/abd
+ls -i src dst
+echo "moving src/bbc over dst/abd, the old dst/abd is replaced, and dst/abd now says:"
+mv -f src/bbc dst/abd
+ls -i src dst
+cat dst/abd
+echo "moving directory dst into src, the link counts of src and dst must be 3 and 2, and src/dst/.. is src:"
+mv dst src/dst
+ls -ld src src/dst
+ls -di src src/dst/..
+rm -rf src
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing hard links with ln, abc and abd must share one inode, with a link count of 2:"
+echo "hello" > abc
+ln abc abd
+ls -li abc abd
+echo "writing through abd, then reading abc:"
+echo "world" >> abd
+cat abc
+echo "deleting abc, abd must still be there, with a link count of 1:"
+rm -f abc
+ls -li abd
+echo ""
+echo "testing symlinks with ln -s, a short target is kept in the inode, so fast uses no data block:"
+ln -s abd fast
+readlink fast
+cat fast
+stat -c "%n: %F, %b blocks" fast
+echo "a target of 128 bytes or more needs a data block, so slow uses one:"
+ln -s ../test/./././././././././././././././././././././././././././././././././././././././././././././././././././././././././././././abd slow
+readlink slow
+cat slow
+stat -c "%n: %F, %b blocks" slow
+rm -f abd fast slow
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing truncate, writing 32KB of x to abc:"
+head -c 32768 /dev/zero | tr '\0' x > abc
+stat -c "%n: %s bytes, %b blocks" abc
+df -k .
+echo "shrinking abc to 5000 bytes, 6 of its 8 blocks must be freed:"
+truncate -s 5000 abc
+stat -c "%n: %s bytes, %b blocks" abc
+df -k .
+echo "growing abc back to 12288 bytes, the bytes after 5000 must read as zeros:"
+truncate -s 12288 abc
+stat -c "%n: %s bytes, %b blocks" abc
+od -A d -c -j 4992 -N 16 abc
+echo "truncating abc with O_TRUNC:"
+: > abc
+stat -c "%n: %s bytes, %b blocks" abc
+rm -f abc
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing sparse files, writing one byte at offset 20480 of sparse, only one block must be allocated:"
+printf x | dd of=sparse bs=4096 seek=5 2>/dev/null
+stat -c "%n: %s bytes, %b blocks" sparse
+echo "the hole reads as zeros:"
+od -A d -c -N 16 sparse
+echo "SEEK_DATA from 0 must give 20480, SEEK_HOLE from 20480 must give 20481 (the end of the file):"
+python3 -c 'import os; fd = os.open("sparse", os.O_RDONLY); print(os.lseek(fd, 0, os.SEEK_DATA), os.lseek(fd, 20480, os.SEEK_HOLE))'
+echo "FIEMAP must report a single extent, at logical block 5:"
+filefrag -v sparse
+rm -f sparse
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing copy.audi, the blocks of abc are copied by the kernel, cmp must say nothing:"
+head -c 32768 /dev/urandom > abc
+../copy.audi abc abd
+stat -c "%n: %s bytes, %b blocks" abc abd
+cmp abc abd
+echo "writing to abd must not change abc:"
+printf x | dd of=abd bs=1 seek=100 conv=notrunc 2>/dev/null
+cmp abc abd
+rm -f abc abd
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing copy.audi -c, abd shares all 8 blocks of abc, so df must show no more blocks used:"
+head -c 32768 /dev/urandom > abc
+df -k .
+../copy.audi -c abc abd
+df -k .
+cmp abc abd
+echo "writing to abd copies one shared block, so abc does not change, and cmp must report byte 101:"
+cp abc abe
+printf x | dd of=abd bs=1 seek=100 conv=notrunc 2>/dev/null
+cmp abc abe
+cmp abc abd
+df -k .
+rm -f abc abd abe
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing compression with chattr +c, on an empty file (this needs lz4 or lzo, and the block size to be the page size):"
+touch abc
+chattr +c abc
+lsattr abc
+echo "writing 32KB of text to abc, then 32KB of text to abd, which is not compressed:"
+yes "audi keeps compressible text in fewer blocks" | head -c 32768 > abc
+yes "audi keeps compressible text in fewer blocks" | head -c 32768 > abd
+sync
+echo "abc must use fewer blocks than abd:"
+stat -c "%n: %s bytes, %b blocks" abc abd
+echo "dropping the page cache, so abc is decompressed when read back, cmp must say nothing:"
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+cmp abc abd
+echo "chattr -c must fail now that abc is not empty:"
+chattr -c abc
+rm -f abc abd
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing block sizes: an image of 64 1KB blocks, /tmp/audi-test.img, mounted on /tmp/audi-test:"
+dd if=/dev/zero of=/tmp/audi-test.img bs=1K count=64 2>/dev/null
+../mkfs.audi -b 1K /tmp/audi-test.img > /dev/null
+mkdir -p /tmp/audi-test
+sudo mount -o loop -t audi /tmp/audi-test.img /tmp/audi-test
+sudo touch /tmp/audi-test/abc
+echo "chattr +c must fail with \"Operation not supported\", compression needs the block size to be the page size:"
+sudo chattr +c /tmp/audi-test/abc
+sudo umount /tmp/audi-test
+echo "an image of 64 8KB blocks must not mount on a machine with 4KB pages:"
+dd if=/dev/zero of=/tmp/audi-test.img bs=8K count=64 2>/dev/null
+../mkfs.audi -b 8K /tmp/audi-test.img > /dev/null
+sudo mount -o loop -t audi /tmp/audi-test.img /tmp/audi-test && sudo umount /tmp/audi-test
+rm -rf /tmp/audi-test /tmp/audi-test.img
+
+echo ""
+echo "testing nanosecond timestamps: setting the mtime of abc to 2020-01-02 03:04:05.123456789:"
+touch abc
+touch -d "2020-01-02 03:04:05.123456789" abc
+stat -c "%n: %y" abc
+echo "syncing and dropping the caches, so abc is read back from the inode table, the mtime must not change:"
+sync
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+stat -c "%n: %y" abc
+rm -f abc
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing unlink of an open file, abc is held open while it is deleted:"
+head -c 32768 /dev/zero | tr '\0' x > abc
+sync
+df -k .
+exec 3< abc
+rm -f abc
+echo "abc is gone from the directory, but its blocks are still used until it is closed:"
+ls -a
+sync
+df -k .
+echo "and it can still be read, wc -c must say 32768:"
+wc -c <&3
+exec 3<&-
+sync
+echo "closed, now the blocks are free again:"
+df -k .
+echo "after deletion we now have:"
+ls -a
+
+echo ""
+echo "testing rm -rf with deferred freeing, this needs the file system mounted with -o deferfree:"
+if grep -q " $(pwd) audi .*deferfree" /proc/mounts; then
+    mkdir tree tree/a tree/b
+    for f in 1 2 3 4 5 6 7 8; do echo "hello" > tree/a/$f; echo "world" > tree/b/$f; done
+    sync
+    df -k .
+    rm -rf tree
+    echo "tree is gone at once, its inodes and blocks are freed in the background, by the time sync returns at the latest:"
+    ls -a
+    sync
+    df -k .
+    df -i .
+else
+    echo "not mounted with -o deferfree, skipping."
+fi
+
+echo ""
+echo "testing inode locality, files of one directory get inode numbers close to the directory's (ls -i):"
+mkdir ddd eee
+touch ddd/abc eee/abc ddd/bbc eee/bbc
+ls -di ddd eee
+ls -i ddd eee
+rm -rf ddd eee
+echo "after deletion we now have:"
+ls -a
@@ -0,0 +1,84 @@
+/**
+ * test-libaudi.c - exercise libaudi on an image, built as test-libaudi, run by test-audi.sh.
+ *
+ * we create a directory and a file in it through libaudi, write the file, then read it back, look both up
+ * and list the directory. test-audi.sh then mounts the image, to check the kernel module sees the same thing.
+ *
+ * Author:
+ *   Jidong Xiao <jidongxiao@boisestate.edu>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libaudi.h"
+
+static const char hello[] = "hello from libaudi\n";
+
+static int print_entry(void *arg, struct audi_dir_entry *de, int slot)
+{
+    printf("\tslot %d: %.*s\n", slot, AUDI_FILENAME_LEN, de->name);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct audi_image img;
+    char buf[sizeof(hello)];
+    int dir, file, ret;
+    ssize_t n;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s disk\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    ret = audi_image_open(&img, argv[1], 1);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(-ret));
+        return EXIT_FAILURE;
+    }
+
+    ret = EXIT_FAILURE;
+    dir = audi_image_create(&img, AUDI_ROOT_INO, "lib", S_IFDIR | 0755);
+    if (dir < 0) {
+        fprintf(stderr, "create lib: %s\n", strerror(-dir));
+        goto out;
+    }
+    file = audi_image_create(&img, dir, "hello", S_IFREG | 0644);
+    if (file < 0) {
+        fprintf(stderr, "create lib/hello: %s\n", strerror(-file));
+        goto out;
+    }
+    printf("created lib (inode %d) and lib/hello (inode %d)\n", dir, file);
+
+    n = audi_image_write(&img, file, hello, strlen(hello), 0);
+    if (n != strlen(hello)) {
+        fprintf(stderr, "write lib/hello: %s\n", n < 0 ? strerror(-n) : "short write");
+        goto out;
+    }
+    memset(buf, 0, sizeof(buf));
+    n = audi_image_read(&img, file, buf, sizeof(buf), 0);
+    if (n != strlen(hello) || memcmp(buf, hello, n)) {
+        fprintf(stderr, "read lib/hello: got %zd bytes, not what we wrote\n", n);
+        goto out;
+    }
+    printf("lib/hello reads back: %s", buf);
+
+    if (audi_image_lookup(&img, AUDI_ROOT_INO, "lib") != dir || audi_image_lookup(&img, dir, "hello") != file ||
+        audi_image_lookup(&img, dir, "hell")) {
+        fprintf(stderr, "lookup does not find what we created\n");
+        goto out;
+    }
+    printf("lib has:\n");
+    audi_image_iterate(&img, dir, print_entry, NULL);
+    ret = EXIT_SUCCESS;
+
+out:
+    audi_image_close(&img);
+    return ret;
+}
+
+/* vim: set ts=4: */